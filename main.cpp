@@ -1,4 +1,17 @@
 #include <bits/stdc++.h>
+#include <immintrin.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 using namespace std;
 
@@ -6,1383 +19,4143 @@ using std::chrono::high_resolution_clock;
 using std::chrono::duration;
 using std::chrono::duration_cast;
 
+// side to move as a template argument, WHITE matches Piece::color == true
+enum Color { BLACK, WHITE };
+
+// two bytes: the flags share the first, the name is the second
 struct Piece {
     // true is white, false is black
-    bool color;
+    bool color : 1;
+    // kings and rooks that moved have lost castling
+    bool moved : 1;
+    // a pawn that just moved two squares, it can be taken en passant for one ply
+    bool passant : 1;
     char name;
-    vector<string> possibleMove;
+
+    Piece() : color(true), moved(false), passant(false), name('-') {}
+};
+
+// the whole board is one flat block of 64 squares, two cache lines, so copy-make is a memcpy
+// board[i][j] is row i (rank 8 - i) and file j
+struct alignas(64) Board {
+    Piece squares[64];
+
+    Piece* operator[](int i) { return squares + i * 8; }
+    const Piece* operator[](int i) const { return squares + i * 8; }
 };
+static_assert(sizeof(Board) == 128 && is_trivially_copyable<Board>::value, "board must stay two flat cache lines");
 
 struct Task {
-    vector<vector<Piece>> boardState;
+    Board boardState;
+    string move;
+    // total plies for this iteration, root move included
+    int depth;
+    // side to move in boardState, the root side is !team
+    bool team;
+    // plies since the last capture or pawn move, root move included
+    int halfmove;
+};
+
+struct Result {
+    int score;
     string move;
+    // the opponent's best answer to move, what we ponder on
+    string reply;
+    // move, reply and the rest of the principal variation
+    vector<string> pv;
+    // what the task cost, the next iteration schedules by it
+    uint64_t nodes;
 };
 
+struct SearchResult {
+    int score;
+    string move;
+    string reply;
+    int depth;
+    // the best --multipv root moves, best first
+    vector<Result> lines;
+};
+
+// told about every finished iteration instead of the uci info lines, with the nodes and milliseconds so far
+typedef function<void(SearchResult& iteration, uint64_t nodes, long long elapsed)> IterationReport;
+
 
 // global queue
 queue<Task> taskQueue;
 
 pthread_mutex_t queueLock;
 pthread_mutex_t resultsLock;
-vector<pair<int, string>> results;
+vector<Result> results;
+
+// the best root score finished so far this iteration, from white's side
+// with one line wanted a root task only has to show whether it reaches it, so its window starts just short of it
+// the bound is taken when the task starts, a task already running keeps its window
+atomic<int> rootBound(0);
+
+// thread pool, workers sleep on queueReady until there is work or shutdown
+pthread_cond_t queueReady;
+pthread_cond_t tasksDone;
+int pendingTasks = 0;
+bool shutdownPool = false;
+
+// distributed search, --workers lists other processes started with --serve
+// each one gets a thread here that takes root tasks off the same queue and sends them over
+struct RemoteWorker {
+    string address;
+    int fd;
+    // bytes read past the last full line
+    string buffer;
+};
+vector<RemoteWorker> remoteWorkers;
+
+// search limits, set from the command line
+int maxDepth = 4;
+int moveTime = 0;
+// stop once this many nodes were searched, 0 for no limit, --nodes N
+uint64_t nodeLimit = 0;
+// how many root moves get an exact score and a line, --multipv N
+int multiPV = 1;
+
+// what the last search expects to happen next, so the following one can pick up from it
+// the position after our move and the predicted reply, how deep the line below it was searched,
+// and the rest of the line from there with its score, the answer until a deeper iteration finishes
+uint64_t reuseKey = 0;
+int reuseDepth = 0;
+Result reuseLine;
+
+// the game's positions since the last capture or pawn move, the current one last
+// its size - 1 is the halfmove clock, the search carries it on in PlyScratch
+vector<uint64_t> gameKeys;
+
+// search control
+// every thread polls stopSearch, set by the time limit, a "stop" command or a signal
+atomic<bool> stopSearch(false);
+// searchDeadline is written before timeLimited is raised, the listener does this on ponderhit
+atomic<bool> timeLimited(false);
+high_resolution_clock::time_point searchDeadline;
+
+// nodes between two polls of the clock, keeps the stop latency bounded
+const int checkInterval = 1024;
+thread_local int nodesUntilCheck = checkInterval;
+
+// commands read from stdin while searching, all guarded by commandLock
+pthread_mutex_t commandLock;
+pthread_cond_t commandReady;
+bool pondering = false;
+bool ponderHit = false;
+string ponderMove;
+queue<string> opponentMoves;
+bool quitRequested = false;
+// set by SIGINT/SIGTERM, the game stops waiting for moves and saves the table on the way out
+// a signal handler can't signal a condition, so the waits for one wake up every signalPoll ms to look
+volatile sig_atomic_t stopSignalled = 0;
+const int signalPoll = 100;
+
+// transposition table
+// shared by all threads without locks, key is stored xor'd with data
+// so an entry torn by two writers simply fails the key check
+struct TTEntry {
+    atomic<uint64_t> key;
+    atomic<uint64_t> data;
+};
 
-// functions for establishing the graph
-void initialBoard(vector<vector<Piece>>& boardState);
-void printBoard(vector<vector<Piece>>& boardState);
-void printPossibleMoves(vector<vector<Piece>>& boardState);
-vector<string> possibleMoves(vector<vector<Piece>>& boardState, int i, int j);
-bool inCheck(vector<vector<Piece>>& boardState, bool team);
+enum Bound { BOUND_UPPER = 1, BOUND_LOWER = 2, BOUND_EXACT = 3 };
+
+TTEntry* transTable = nullptr;
+size_t ttMask = 0;
+size_t ttBytes = 0;
+// the mapping transTable sits in, a little larger when it had to be aligned by hand
+void* ttMemory = nullptr;
+size_t ttMemoryBytes = 0;
+const size_t HUGE_PAGE = 2 * 1024 * 1024;
+
+// --hash-file, the table is loaded from it at startup and written back on the way out
+// the header says which engine and keys the entries belong to, the entries follow at HASH_HEADER_BYTES
+// bump HASH_FILE_VERSION whenever the entry layout, the move encoding or the hashing changes
+string ttFile;
+const uint32_t HASH_FILE_VERSION = 3;
+const size_t HASH_HEADER_BYTES = 4096;
+const uint64_t ZOBRIST_SEED = 0x5EED1234ULL;
+struct HashFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t entrySize;
+    uint64_t entries;
+    uint64_t seed;
+    uint8_t generation;
+};
+uint8_t ttGeneration = 0;
+
+// numa topology from sysfs, --numa pins the search threads across the nodes
+// and interleaves the transposition table's pages over them
+struct NumaNode {
+    int id;
+    string cpuList;
+    vector<int> cpus;
+};
+vector<NumaNode> numaNodes;
+bool numaMode = false;
+// the kernel's interleave policy, set through the raw syscall so no libnuma is needed
+const int NUMA_INTERLEAVE = 3;
+
+// zobrist keys [color][piece][square], the side to move, castling rights and en passant file
+uint64_t zobristPieces[2][6][64];
+uint64_t zobristBlackToMove;
+uint64_t zobristCastling[4];
+uint64_t zobristEnPassant[8];
+
+// opening book in the Polyglot .bin format, 16 byte big-endian entries sorted by key
+// the file is memory mapped, lookups binary search it in place
+const unsigned char* bookData = nullptr;
+size_t bookEntries = 0;
+// polyglot key layout: 12 piece kinds x 64 squares, 4 castling rights, 8 en passant files, white to move
+uint64_t bookKeys[781];
+// keys of a few lines from the polyglot format description, any table in use has to give them
+const vector<pair<string, uint64_t>> POLYGLOT_TEST_KEYS = {
+    {"", 0x463B96181691FC9CULL},
+    {"e2e4", 0x823C9B50FD114196ULL},
+    {"e2e4 d7d5", 0x0756B94461C50FB0ULL},
+    {"e2e4 d7d5 e4e5", 0x662FAFB965DB29D4ULL},
+    {"e2e4 d7d5 e4e5 f7f5", 0x22A48B5A8E47FF78ULL},
+    {"e2e4 d7d5 e4e5 f7f5 e1e2", 0x652A607CA3F242C1ULL},
+    {"e2e4 d7d5 e4e5 f7f5 e1e2 e8f7", 0x00FDD303C946BDD9ULL},
+    {"a2a4 b7b5 h2h4 b5b4 c2c4", 0x3C8123EA7B067637ULL},
+    {"a2a4 b7b5 h2h4 b5b4 c2c4 b4c3 a1a3", 0x5C3F9B829B279560ULL}
+};
+
+// mate scores sit above anything evaluateScore returns, less the plies to the mate
+const int MATE_SCORE = 30000;
+
+// move generation, captures include promotions
+enum GenType { GEN_ALL, GEN_CAPTURES, GEN_QUIETS };
+
+// moves of one node are handed out in stages, each stage is only generated
+// once the one before it is used up, a cutoff on the hash move generates nothing
+// captures that lose material by static exchange come after the winning ones
+enum PickStage { PICK_HASH, PICK_GEN_CAPTURES, PICK_CAPTURES, PICK_BAD_CAPTURES, PICK_KILLERS, PICK_GEN_QUIETS, PICK_QUIETS, PICK_DONE };
+
+// piece values for capture ordering and static exchange, P N B R Q K
+const int seeValue[6] = { 1, 3, 3, 5, 9, 100 };
+
+// fixed size move list, moves are short enough for std::string to keep them in place
+// so filling one never touches the heap
+const int MAX_MOVES = 256;
+struct MoveList {
+    string moves[MAX_MOVES];
+    int size = 0;
+};
 
+struct MovePicker {
+    Board* boardState;
+    string hashMove;
+    // the two killers, then the countermove
+    string killers[3];
+    // the moves before this one as moveIndex, -1 if there is none, for the history tables
+    int counter = -1;
+    int followup = -1;
+    int stage = PICK_HASH;
+    // all three live in the ply's scratch slot
+    MoveList* moves;
+    MoveList* scratch;
+    MoveList* bad;
+    int index = 0;
+};
+
+// killers: quiet moves that cut off at the same ply elsewhere in the tree, two per ply
+// per thread, a root task searches its own subtree
+const int MAX_PLY = 128;
+thread_local string killerMoves[MAX_PLY][2];
+
+// what quiet cutoffs taught, shared by every thread so a refutation found in one root task
+// orders the moves of the others straight away; relaxed atomics, a lost update only costs ordering
+// moves are keyed by moveIndex: the moving piece (pieceIndex, + 6 for black) * 64 + target square
+// counterMoves: the quiet move that last refuted a move, 0 for none, else 4096 | from << 6 | to
+// counterHistory / followupHistory: how quiet moves did after the opponent's last move,
+// and after our own move before that, kept within +-HISTORY_MAX
+const int HISTORY_MAX = 16384;
+atomic<uint16_t> counterMoves[12 * 64];
+atomic<int16_t> counterHistory[12 * 64][12 * 64];
+atomic<int16_t> followupHistory[12 * 64][12 * 64];
+
+// triangular pv table, pvTable[ply] holds the best line found from ply on, up to pvLength[ply]
+// a new best move at a ply copies the child's line in behind it, the strings never leave their buffers
+thread_local string pvTable[MAX_PLY][MAX_PLY];
+thread_local int pvLength[MAX_PLY];
+
+// nodes searched by this thread, added to searchNodes after every root task
+thread_local uint64_t nodeCount = 0;
+atomic<uint64_t> searchNodes(0);
+
+// extensions: a move that gives check, recaptures, pushes a pawn to the seventh rank
+// or is the only good move of its node (singular) is searched one ply deeper
+// lines only grow to twice the depth of the task they belong to
+thread_local int taskDepth = 0;
+// the hash move is singular if every other move, searched to half the depth,
+// stays SINGULAR_MARGIN per ply worse than its table score
+const int SINGULAR_DEPTH = 4;
+const int SINGULAR_MARGIN = 10;
+
+// optional neural network evaluation, --nnue FILE
+// 768 inputs per side (own/their piece kind x square, seen from that side's end of the board)
+// into nnueHidden int16 accumulators per side, clipped to 0..127 and weighted by int8 into one output
+// file layout, little endian:
+//   "CMPNNUE1", uint32 hidden (a multiple of 32),
+//   int16 feature weights [768][hidden], int16 feature bias [hidden],
+//   int8 output weights [2 * hidden] (side to move's half first), int32 output bias
+// eval = (output bias + sum) / 64, in the same units as evaluateScore
+const int NNUE_FEATURES = 768;
+const int NNUE_MAX_HIDDEN = 512;
+bool nnueEnabled = false;
+int nnueHidden = 0;
+vector<int16_t> nnueFeatureWeights;
+vector<int16_t> nnueFeatureBias;
+vector<int8_t> nnueOutputWeights;
+int32_t nnueOutputBias = 0;
+
+// [white's view][black's view], kept up to date move by move instead of summed at every leaf
+struct Accumulator {
+    alignas(32) int16_t values[2][NNUE_MAX_HIDDEN];
+};
+
+int nnueOutputScalar(const int16_t* us, const int16_t* them, const int8_t* weights, int hidden);
+int nnueOutputAVX2(const int16_t* us, const int16_t* them, const int8_t* weights, int hidden);
+int (*nnueOutput)(const int16_t* us, const int16_t* them, const int8_t* weights, int hidden) = nnueOutputScalar;
+
+// per thread scratch memory, one slot per ply, allocated once and reused by every search
+// the child board is copied into the slot (copy-make)
+// the accumulator belongs to the board searched at that ply
+struct PlyScratch {
+    Board board;
+    MoveList moves;
+    MoveList scratch;
+    MoveList bad;
+    Accumulator accumulator;
+    // the position's key and halfmove clock, walked back to find repetitions
+    uint64_t key;
+    int halfmove;
+    // square the move into this position captured on (i * 8 + j), -1 if it captured nothing
+    int captureSquare;
+    // the move into this position as a moveIndex
+    int lastMove;
+};
+thread_local vector<PlyScratch> plyScratch;
 
-bool validSpot(string& pos, vector<vector<Piece>>& boardState);
+// functions for establishing the graph
+void initialBoard(Board& boardState);
+void printBoard(Board& boardState);
+void printPossibleMoves(Board& boardState);
+vector<string> legalMoves(Board& boardState, bool team, int genType = GEN_ALL, int onlySquare = -1);
+template<Color Us> void generateMoves(Board& boardState, MoveList& list, int genType = GEN_ALL, int onlySquare = -1);
+void generateMoves(Board& boardState, bool team, MoveList& list, int genType = GEN_ALL, int onlySquare = -1);
+template<Color By> bool squareAttacked(Board& boardState, int i, int j);
+bool squareAttacked(Board& boardState, int i, int j, bool byTeam);
+template<Color Us> bool inCheck(Board& boardState);
+bool inCheck(Board& boardState, bool team);
+int castlingRights(Board& boardState);
+bool onBoard(int i, int j);
 
 
 // functions to play the game
-void playFirstMoves(vector<vector<Piece>>& boardState, vector<string>& moveList);
+void playFirstMoves(Board& boardState, vector<string>& moveList);
+void playMove(Board& boardState, string& move, bool team);
+void recordMove(Board& boardState, string& move);
+string parseMove(Board& boardState, string& move, bool team);
+void playBestMove(Board& boardState, SearchResult& result, high_resolution_clock::time_point begin, int ntasks);
 void convertToIJ(string& move, int& iVal, int& jVal);
 string convertToUCI(int iCurr, int jCurr, int iEnd, int jEnd);
+string convertToUCI(string& move);
 
 // minimax functions
-pair<int, string> minimax(vector<vector<Piece>> boardState, int depth, bool team, string bestMove, int alpha, int beta);
-int evaluateScore(vector<vector<Piece>>& boardState, bool team);
-void simulateMove(vector<vector<Piece>>& boardState, int i, int j, string& move);
+template<Color Us> pair<int, string> minimax(Board& boardState, int depth, int maxDepth, string bestMove, int alpha, int beta);
+pair<int, string> minimax(Board& boardState, int depth, int maxDepth, bool team, string bestMove, int alpha, int beta);
+template<Color Us> int evaluateScore(Board& boardState);
+int evaluateScore(Board& boardState, bool team);
+int moveIndex(Piece& piece, string& move);
+void updateHistory(atomic<int16_t>& entry, int bonus);
+void initEval();
+void loadNNUE(string& path);
+void nnueRefresh(Board& boardState, Accumulator& accumulator);
+void nnueUpdate(Accumulator& parent, Accumulator& child, Board& boardState, string& move);
+int nnueEvaluate(Accumulator& accumulator, bool team);
+int scoreMaterialScalar(Board& boardState);
+int scoreMaterialAVX2(Board& boardState);
+void initPicker(MovePicker& picker, Board& boardState, string& hashMove, int ply);
+template<Color Us> bool nextMove(MovePicker& picker, string& move);
+bool isCapture(Board& boardState, string& move);
+int see(Board& boardState, string& move);
+int leastValuableAttacker(Board& squares, int i, int j, bool side, int& fromI, int& fromJ);
+bool isIrreversible(Board& boardState, string& move);
+bool isDraw(uint64_t key, int ply);
+void simulateMove(Board& boardState, string& move);
+SearchResult searchPosition(Board& boardState, bool team, bool ponder, IterationReport report = nullptr);
+void updatePV(int ply, string& move);
+string uciScore(int score, bool team);
+
+// transposition table functions
+void initZobrist();
+void initNuma();
+vector<int> parseCpuList(string& list);
+void numaAffinity(pthread_attr_t& attr, int index);
+uint64_t hashBoard(Board& boardState, bool team);
+void resizeTT(size_t megabytes);
+bool transparentHugePages();
+void* touchTTRange(void* arg);
+void touchTT(int threads);
+bool loadTT(string& path);
+void saveTT(string& path);
+bool probeTT(uint64_t key, int ply, int& score, int& depth, int& bound, string& move);
+void storeTT(uint64_t key, int ply, int score, int depth, int bound, string move);
+
+// opening book functions
+void initBookKeys();
+void loadBookKeys(string& path);
+bool bookKeysMatch();
+bool openBook(string& path);
+uint64_t bookKey(Board& boardState, bool team);
+string probeBook(Board& boardState, bool team);
+void makeBook(string& path);
+
+
+// search control functions
+bool shouldStop();
+void handleStopSignal(int sig);
+void pollWait(pthread_cond_t& ready, pthread_mutex_t& lock);
+void releasePool(vector<pthread_t>& threads);
+void* listenForCommands(void* arg);
+bool isMoveString(string& command);
+
+
+// distributed search functions
+bool popTask(Task& task);
+void finishTask();
+void runTask(Task& task);
+void tightenRootBound(int score, bool rootTeam);
+int openSocket(string& address, bool listening);
+bool sendLine(int fd, const string& line);
+int readLine(int fd, string& buffer, string& line, int timeout);
+string encodeBoard(Board& boardState);
+bool decodeBoard(string& encoded, Board& boardState);
+bool searchRemote(RemoteWorker& remote, Task& task);
+void* remoteWorker(void* arg);
+void* readCoordinator(void* arg);
+void serveSearches(string& address);
+
+// analysis server functions
+struct AnalysisClient;
+struct AnalysisRequest;
+string jsonString(const string& text);
+string jsonScore(int score, bool team);
+bool sendClient(AnalysisClient& client, const string& line);
+bool parseRequest(string& line, AnalysisRequest& request, string& error);
+void* readClient(void* arg);
+void* acceptClients(void* arg);
+high_resolution_clock::time_point requestDeadline(AnalysisRequest& request);
+long long requestBudget(AnalysisRequest& request);
+void runRequest(AnalysisRequest& request, long long budget);
+void handleServerSignal(int sig);
+void serveAnalysis(string& address, int queueLimit);
+
+// self-play match functions
+struct EngineProcess;
+struct MatchState;
+bool startEngine(EngineProcess& engine, string& options, vector<string>& moves);
+bool engineMove(EngineProcess& engine, string& move, uint64_t& nodes, long long& milliseconds);
+void stopEngine(EngineProcess& engine);
+string toSAN(Board& boardState, string& move, bool team);
+bool insufficientMaterial(Board& boardState);
+string playMatchGame(MatchState& match, string& opening, bool firstWhite, string& pgnMoves, string& termination);
+void* playMatchGames(void* arg);
+void runMatch(vector<string>& engines, int games, int concurrency, string& openingsPath, string& pgnPath);
 
 
 // parallel function
 // no need for trampoline, queue is globally used
-void* worker(void* arg) {
-    while (true) {
-        Task task;
-
-        // Lock
-        pthread_mutex_lock(&queueLock);
-        if (taskQueue.empty()) {
-            pthread_mutex_unlock(&queueLock);
-            // nothing else for this thread to do!
-            break;
-        }
+// workers stay alive between iterations and only exit on shutdown
+void* worker(void*) {
+    Task task;
+    while (popTask(task)) {
+        // once stopped, remaining tasks are drained without searching them
+        if (!stopSearch.load(memory_order_relaxed)) runTask(task);
+        finishTask();
+    }
+    return NULL;
+}
 
-        // Pop a task from the queue
-        task = taskQueue.front();
-        taskQueue.pop();
+// blocks until there is a task, false once the pool shuts down
+bool popTask(Task& task) {
+    // Lock
+    pthread_mutex_lock(&queueLock);
+    while (taskQueue.empty() && !shutdownPool) {
+        pthread_cond_wait(&queueReady, &queueLock);
+    }
+    if (taskQueue.empty()) {
         pthread_mutex_unlock(&queueLock);
-
-        // Compute the minimax result
-        string bestMove;
-        int score = minimax(task.boardState, 1, false, bestMove, -INT_MAX, INT_MAX).first;
-
-        // Lock
-        pthread_mutex_lock(&resultsLock);
-        results.push_back({score, task.move});
-        pthread_mutex_unlock(&resultsLock);
+        // shutting down, nothing else for this thread to do!
+        return false;
     }
-    return NULL;
+
+    // Pop a task from the queue
+    task = taskQueue.front();
+    taskQueue.pop();
+    pthread_mutex_unlock(&queueLock);
+    return true;
 }
 
+void finishTask() {
+    pthread_mutex_lock(&queueLock);
+    if (--pendingTasks == 0) pthread_cond_signal(&tasksDone);
+    pthread_mutex_unlock(&queueLock);
+}
 
-int main(int argc, char* argv[]) {
+// searches one root task on this thread and adds it to results
+void runTask(Task& task) {
+    // scratch for every ply this thread will ever search, allocated on its first task
+    if (plyScratch.empty()) plyScratch.resize(MAX_PLY);
+
+    // the only full accumulator refresh, every node below is updated from its parent
+    if (nnueEnabled) nnueRefresh(task.boardState, plyScratch[1].accumulator);
+    plyScratch[1].halfmove = task.halfmove;
+    plyScratch[1].captureSquare = -1;
+    plyScratch[1].lastMove = moveIndex(task.boardState[task.move[2] - '0'][task.move[3] - '0'], task.move);
+    taskDepth = task.depth;
+
+    // a move that can't match the best one finished so far fails low with a score strictly worse than it,
+    // which sorts it behind; the window takes in the bound itself, so a move scoring the same is exact
+    // and a tie is always between exact scores
+    int alpha = -INT_MAX, beta = INT_MAX;
+    if (multiPV == 1) {
+        int bound = rootBound.load();
+        if (task.team && bound != INT_MAX) beta = bound + 1;
+        else if (!task.team && bound != -INT_MAX) alpha = bound - 1;
+    }
 
-    if(argc != 2) throw runtime_error("Please include number of threads in arguements.");
+    // Compute the minimax result
+    string bestMove;
+    nodeCount = 0;
+    pair<int, string> searched = minimax(task.boardState, 1, task.depth, task.team, bestMove, alpha, beta);
+    searchNodes.fetch_add(nodeCount, memory_order_relaxed);
 
-    int ntasks = stoi(argv[1]);
+    // an aborted search returns garbage, only keep finished tasks
+    if (!stopSearch.load(memory_order_relaxed)) {
+        Result result = {searched.first, task.move, task.depth > 1 ? searched.second : "", {}, nodeCount};
+        result.pv.push_back(task.move);
+        for(int p = 1; p < pvLength[1]; ++p) result.pv.push_back(pvTable[1][p]);
+        tightenRootBound(result.score, !task.team);
 
-    ios_base::sync_with_stdio(false);
-    cin.tie(NULL);
+        // Lock
+        pthread_mutex_lock(&resultsLock);
+        results.push_back(result);
+        pthread_mutex_unlock(&resultsLock);
+    }
+}
 
-    vector<vector<Piece>> boardState(8, vector<Piece>(8));
-    initialBoard(boardState);
+// the root side wants the highest score when it is white, the lowest when black
+void tightenRootBound(int score, bool rootTeam) {
+    int bound = rootBound.load();
+    while ((rootTeam ? score > bound : score < bound) && !rootBound.compare_exchange_weak(bound, score)) {}
+}
 
-    // Example input:
+// addresses are a unix socket path (anything with a '/'), host:port, or just a port
+// a bare port listens on every interface, or connects to this machine
+int openSocket(string& address, bool listening) {
+    int fd;
+    if(address.find('/') != string::npos) {
+        sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        if(address.size() >= sizeof(addr.sun_path)) throw runtime_error("Socket path too long " + address);
+        strcpy(addr.sun_path, address.c_str());
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(fd < 0) throw runtime_error("Cannot create socket for " + address);
+        if(listening) {
+            unlink(address.c_str());
+            if(::bind(fd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+                throw runtime_error("Cannot listen on " + address);
+            }
+        } else if(connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
 
-    // If depth is odd olways chooses a black move
-    /*
+    size_t colon = address.rfind(':');
+    string host = colon == string::npos ? "" : address.substr(0, colon);
+    string port = colon == string::npos ? address : address.substr(colon + 1);
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if(listening) hints.ai_flags = AI_PASSIVE;
+    addrinfo* found;
+    if(getaddrinfo(host.empty() ? NULL : host.c_str(), port.c_str(), &hints, &found) != 0) {
+        throw runtime_error("Cannot resolve " + address);
+    }
 
-    Example Game vs Stockfish
-    Graph Generated on this Input
-    24
-    e2e4 e7e5 g1f3 b8c6 f1c4 g8f6 d2d3 f8c5 c2c3 d7d6 c4f7 e8f7 c3c4 f7e8 b1c3 h7h6 f3e5 d6e5 d1h5 f6h5 c3d5 c5f2 e1f2 h8f8
-    
-    4
-    e2e4 g8f6 e4e5 f6d5
+    fd = -1;
+    for(addrinfo* a = found; a && fd < 0; a = a->ai_next) {
+        fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if(fd < 0) continue;
+        int on = 1;
+        if(listening) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        bool ok = listening ? ::bind(fd, a->ai_addr, a->ai_addrlen) == 0 && listen(fd, 16) == 0
+                            : connect(fd, a->ai_addr, a->ai_addrlen) == 0;
+        if(!ok) {
+            close(fd);
+            fd = -1;
+        } else if(!listening) {
+            // task and result lines are small, send them right away
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        }
+    }
+    freeaddrinfo(found);
+    if(fd < 0 && listening) throw runtime_error("Cannot listen on " + address);
+    return fd;
+}
 
+bool sendLine(int fd, const string& line) {
+    string out = line + "\n";
+    size_t sent = 0;
+    while(sent < out.size()) {
+        // a closed peer shows up as an error here instead of SIGPIPE
+        ssize_t n = send(fd, out.data() + sent, out.size() - sent, MSG_NOSIGNAL);
+        if(n <= 0) return false;
+        sent += n;
+    }
+    return true;
+}
 
-    */
+// 1 with a line, 0 when nothing came within timeout ms (-1 waits forever), -1 once the peer is gone
+int readLine(int fd, string& buffer, string& line, int timeout) {
+    while(true) {
+        size_t end = buffer.find('\n');
+        if(end != string::npos) {
+            line = buffer.substr(0, end);
+            buffer.erase(0, end + 1);
+            return 1;
+        }
 
-    int numInput;
-    cin >> numInput;
-    vector<string> moveList(numInput);
-    for(auto& move : moveList) cin >> move;
+        pollfd waiting = {fd, POLLIN, 0};
+        int ready = poll(&waiting, 1, timeout);
+        if(ready == 0) return 0;
+        if(ready < 0) return -1;
 
-    playFirstMoves(boardState, moveList);
-    printBoard(boardState);
+        char chunk[4096];
+        ssize_t n = read(fd, chunk, sizeof(chunk));
+        if(n <= 0) return -1;
+        buffer.append(chunk, n);
+    }
+}
 
+// two characters a square, the piece (lowercase for black, '-' for empty) and moved + 2 * passant
+string encodeBoard(Board& boardState) {
+    string encoded;
     for(int i = 0; i < 8; ++i) {
         for(int j = 0; j < 8; ++j) {
-            if(boardState[i][j].name != '-') {
-                boardState[i][j].possibleMove = possibleMoves(boardState, i, j);
-            }
+            Piece& piece = boardState[i][j];
+            encoded += piece.name == '-' || piece.color ? piece.name : (char)tolower(piece.name);
+            encoded += (char)('0' + piece.moved + 2 * piece.passant);
         }
     }
+    return encoded;
+}
 
-    printPossibleMoves(boardState);
-
-
-    // here the board has the most updated moves, so we want to set up all of the tasks
-    // each task holds a new updated board state, and the move associated with that state
+// false for anything encodeBoard could not have written, the board is then left half filled
+bool decodeBoard(string& encoded, Board& boardState) {
+    if(encoded.size() != 128) return false;
+    int kings[2] = {0, 0};
     for(int i = 0; i < 8; ++i) {
         for(int j = 0; j < 8; ++j) {
-            if(boardState[i][j].name != '-' && boardState[i][j].color) {
-                for(auto x : boardState[i][j].possibleMove) {
-                    // void simulateMove(vector<vector<Piece>>& boardState, int i, int j, string& move);
-                    vector<vector<Piece>> boardStateCpy = boardState;
-                    simulateMove(boardStateCpy, i, j, x);
-                    Task toPush;
-                    toPush.boardState = boardStateCpy;
-                    toPush.move = to_string(i) + to_string(j) + x;
-                    taskQueue.push(toPush);
-                }
-            }
+            char name = encoded[(i * 8 + j) * 2];
+            int flags = encoded[(i * 8 + j) * 2 + 1] - '0';
+            if(string("PNBRQK-").find(toupper(name)) == string::npos || flags < 0 || flags > 3) return false;
+            if(toupper(name) == 'K') ++kings[isupper(name) ? 1 : 0];
+            Piece& piece = boardState[i][j];
+            piece.name = toupper(name);
+            piece.color = name == '-' || isupper(name);
+            piece.moved = flags & 1;
+            piece.passant = flags & 2;
         }
     }
+    return kings[0] == 1 && kings[1] == 1;
+}
 
+// one root task on another process, false if it could not be reached
+// task <depth> <team> <halfmove> <move> <board> <keys> <key>...
+// answered by result <score> <nodes> <reply or -> <pv>... or aborted <nodes>
+bool searchRemote(RemoteWorker& remote, Task& task) {
+    if(remote.fd < 0) return false;
+
+    stringstream request;
+    request << "task " << task.depth << " " << task.team << " " << task.halfmove << " " << task.move
+            << " " << encodeBoard(task.boardState) << " " << gameKeys.size() << hex;
+    for(auto key : gameKeys) request << " " << key;
+
+    bool sent = sendLine(remote.fd, request.str());
+    bool stopSent = false;
+    string line;
+    while(sent) {
+        // without local threads nobody else is watching the clock
+        if(timeLimited && high_resolution_clock::now() >= searchDeadline) stopSearch.store(true);
+
+        // a stopped search is passed on so the worker gives up its task early
+        if(stopSearch.load(memory_order_relaxed) && !stopSent) {
+            stopSent = true;
+            if(!sendLine(remote.fd, "stop")) break;
+        }
+        int got = readLine(remote.fd, remote.buffer, line, 10);
+        if(got < 0) break;
+        if(got == 0) continue;
+
+        stringstream reply(line);
+        string kind;
+        uint64_t nodes;
+        reply >> kind;
+        if(kind == "aborted" && reply >> nodes) {
+            searchNodes.fetch_add(nodes, memory_order_relaxed);
+            return true;
+        }
+        Result result = {};
+        if(kind == "result" && reply >> result.score >> nodes >> result.reply) {
+            searchNodes.fetch_add(nodes, memory_order_relaxed);
+            if(result.reply == "-") result.reply = "";
+            result.move = task.move;
+            result.nodes = nodes;
+            string move;
+            while(reply >> move) result.pv.push_back(move);
+            if(!stopSearch.load(memory_order_relaxed)) {
+                tightenRootBound(result.score, !task.team);
+                pthread_mutex_lock(&resultsLock);
+                results.push_back(result);
+                pthread_mutex_unlock(&resultsLock);
+            }
+            return true;
+        }
+        cerr << "unexpected reply from " << remote.address << ": " << line << endl;
+    }
 
-    pthread_mutex_init(&queueLock, NULL);
-    pthread_mutex_init(&resultsLock, NULL);
+    cerr << "lost worker " << remote.address << ", searching its tasks here" << endl;
+    close(remote.fd);
+    remote.fd = -1;
+    return false;
+}
 
+// takes part in the pool like worker(), but hands its tasks to another process
+void* remoteWorker(void* arg) {
+    RemoteWorker& remote = *(RemoteWorker*)arg;
+    Task task;
+    while (popTask(task)) {
+        if (!stopSearch.load(memory_order_relaxed) && !searchRemote(remote, task)) runTask(task);
+        finishTask();
+    }
+    return NULL;
+}
 
-    string printMove;
+// self-play matches, --match GAMES with two --engine configurations
+// every game runs two engine processes (this binary with --game and the configuration's options)
+// the thread count is how many games are played at once, each engine searches on one thread
 
-    bool team = true;
+// played when no --openings file is given, each one twice with the colors swapped
+const vector<string> defaultOpenings = {
+    "e2e4 e7e5 g1f3 b8c6", "e2e4 c7c5 g1f3 d7d6", "e2e4 e7e6 d2d4 d7d5", "e2e4 c7c6 d2d4 d7d5",
+    "d2d4 d7d5 c2c4 e7e6", "d2d4 g8f6 c2c4 g7g6", "d2d4 g8f6 c2c4 e7e6", "c2c4 e7e5 b1c3 g8f6",
+    "g1f3 d7d5 g2g3 g8f6", "e2e4 d7d5 e4d5 d8d5",
+};
+// a game still going after this many plies is scored as a draw
+const int MAX_GAME_PLIES = 400;
+
+struct EngineProcess {
+    pid_t pid;
+    // one socket is the engine's stdin and stdout
+    int fd;
+    string buffer;
+};
 
-    // Start a timer
-    high_resolution_clock::time_point begin = high_resolution_clock::now();
+struct MatchState {
+    vector<string> engines;
+    vector<string> openings;
+    int games;
+    // game index handed out next, and the games finished so far
+    int nextGame;
+    int played;
+    // from the first engine's side
+    int wins, losses, draws;
+    // per engine, summed over the moves' last completed iterations
+    uint64_t nodes[2];
+    long long milliseconds[2];
+    bool stopped;
+    ofstream pgn;
+    pthread_mutex_t lock;
+};
 
-    // setup thread vector
-    vector<pthread_t> threads(ntasks);
+// runs this binary as an engine that keeps playing, the game so far is its input
+bool startEngine(EngineProcess& engine, string& options, vector<string>& moves) {
+    vector<string> words = {"chess", "1"};
+    stringstream split(options);
+    string word;
+    while(split >> word) words.push_back(word);
+    words.push_back("--game");
+    vector<char*> args;
+    for(auto& w : words) args.push_back((char*)w.c_str());
+    args.push_back(NULL);
+
+    // close-on-exec, or the engines of the other games running at the same time inherit this
+    // socket and keep it open, and the engine never sees its input end; dup2 clears it for 0 and 1
+    int sockets[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets) < 0) return false;
+    engine.pid = fork();
+    if(engine.pid < 0) return false;
+    if(engine.pid == 0) {
+        dup2(sockets[1], 0);
+        dup2(sockets[1], 1);
+        int null = open("/dev/null", O_WRONLY);
+        if(null >= 0) dup2(null, 2);
+        close(sockets[0]);
+        execv("/proc/self/exe", args.data());
+        _exit(127);
+    }
+    close(sockets[1]);
+    engine.fd = sockets[0];
+    engine.buffer.clear();
+
+    stringstream input;
+    input << moves.size() << "\n";
+    for(auto& move : moves) input << move << " ";
+    return sendLine(engine.fd, input.str());
+}
 
-    for(int i=0; i < ntasks; ++i) {
-        int status = ::pthread_create(&threads[i], nullptr, worker, nullptr);
-        if (status != 0) {
-            ::perror("thread create");
-            return 1;
+// waits for the engine's next move, the only output line that is nothing but a move
+bool engineMove(EngineProcess& engine, string& move, uint64_t& nodes, long long& milliseconds) {
+    string line;
+    nodes = 0;
+    milliseconds = 0;
+    while(readLine(engine.fd, engine.buffer, line, 5 * 60 * 1000) > 0) {
+        if(isMoveString(line)) {
+            move = line;
+            return true;
+        }
+        // info depth ... nodes N nps N time MS pv ...
+        stringstream info(line);
+        string word;
+        info >> word;
+        if(word != "info") continue;
+        while(info >> word) {
+            if(word == "nodes") info >> nodes;
+            else if(word == "time") info >> milliseconds;
         }
     }
+    return false;
+}
 
-    // Wait for all to finish
-    for(int i=0; i < ntasks; ++i) {
-        pthread_join(threads[i], nullptr);
+void stopEngine(EngineProcess& engine) {
+    if(engine.pid <= 0) return;
+    // end of input is a quit for an engine in --game mode
+    close(engine.fd);
+    int status;
+    for(int wait = 0; wait < 100 && waitpid(engine.pid, &status, WNOHANG) == 0; ++wait) usleep(10000);
+    if(waitpid(engine.pid, &status, WNOHANG) == 0) {
+        kill(engine.pid, SIGKILL);
+        waitpid(engine.pid, &status, 0);
     }
+    engine.pid = 0;
+}
 
-    int bestScore = -INT_MAX;
-    string bestMove;
-    cout << endl << endl << endl;
-    for(int i = 0; i < results.size(); ++i) {
-        if(results[i].first > bestScore) {
-            bestScore = results[i].first;
-            bestMove = results[i].second;
+// e4, Nbd2, exd5, e8=Q+, O-O, as pgn writes them
+string toSAN(Board& boardState, string& move, bool team) {
+    int fromI = move[0] - '0', fromJ = move[1] - '0', toI = move[2] - '0', toJ = move[3] - '0';
+    Piece& mover = boardState[fromI][fromJ];
+    string target = string(1, 'a' + toJ) + (char)('8' - toI);
+    bool capture = boardState[toI][toJ].name != '-' || (mover.name == 'P' && fromJ != toJ);
+
+    string san;
+    if(mover.name == 'K' && abs(toJ - fromJ) == 2) san = toJ > fromJ ? "O-O" : "O-O-O";
+    else if(mover.name == 'P') {
+        if(capture) san = string(1, 'a' + fromJ) + "x";
+        san += target;
+        if(move.size() == 5) san += string("=") + move[4];
+    } else {
+        // name the file, or the rank, or both when another piece of the kind could go there too
+        bool other = false, sameFile = false, sameRank = false;
+        for(auto& legal : legalMoves(boardState, team)) {
+            if(legal.compare(2, 2, move, 2, 2) != 0 || legal.compare(0, 2, move, 0, 2) == 0) continue;
+            if(boardState[legal[0] - '0'][legal[1] - '0'].name != mover.name) continue;
+            other = true;
+            if(legal[1] == move[1]) sameFile = true;
+            if(legal[0] == move[0]) sameRank = true;
         }
+        san = mover.name;
+        if(other && (!sameFile || sameRank)) san += (char)('a' + fromJ);
+        if(other && sameFile) san += (char)('8' - fromI);
+        san += (capture ? "x" : "") + target;
     }
-    cout << endl << bestScore << "  " << bestMove << endl;
 
-    // bestMove = minimax(boardState, 0, team, bestMove, -INT_MAX, INT_MAX).second;
-    // int score = minimax(boardState, 0, !team, bestMove, -INT_MAX, INT_MAX).first;
-
-    // cout << "score " << score << endl << endl;
-
-
-    printMove = convertToUCI(stoi(bestMove.substr(0, 1)), stoi(bestMove.substr(1, 1)), stoi(bestMove.substr(2, 1)), stoi(bestMove.substr(3, 1)));
-
-    cout << printMove << endl;
+    Board after = boardState;
+    simulateMove(after, move);
+    if(inCheck(after, !team)) san += legalMoves(after, !team).empty() ? "#" : "+";
+    return san;
+}
 
-    int currI = stoi(bestMove.substr(0, 1));
-    int currJ = stoi(bestMove.substr(1, 1));
+// neither side has the material left to mate
+bool insufficientMaterial(Board& boardState) {
+    int minors = 0;
+    for(auto& piece : boardState.squares) {
+        if(piece.name == 'P' || piece.name == 'R' || piece.name == 'Q') return false;
+        if(piece.name == 'N' || piece.name == 'B') ++minors;
+    }
+    return minors <= 1;
+}
 
-    string tempMove = bestMove.substr(2, 2);
+// plays one game, engine firstWhite ? 0 : 1 has white, returns the result from white's side
+string playMatchGame(MatchState& match, string& opening, bool firstWhite, string& pgnMoves, string& termination) {
+    Board boardState;
+    initialBoard(boardState);
+    bool team = true;
+    vector<string> played;
+    // keys since the last capture or pawn move, for threefold repetition
+    vector<uint64_t> keys = {hashBoard(boardState, team)};
+    stringstream moveText;
+
+    auto apply = [&](string& uciMove) {
+        string move = parseMove(boardState, uciMove, team);
+        if(team) moveText << played.size() / 2 + 1 << ". ";
+        moveText << toSAN(boardState, move, team) << " ";
+        if(isIrreversible(boardState, move)) keys.clear();
+        simulateMove(boardState, move);
+        team = !team;
+        keys.push_back(hashBoard(boardState, team));
+        played.push_back(uciMove);
+    };
 
-    for(int i = 0; i < 8; ++i) {
-        for(int j = 0; j < 8; ++j) {
-            if(boardState[i][j].name != '-') {
-                boardState[i][j].possibleMove = possibleMoves(boardState, i, j);
+    stringstream openingMoves(opening);
+    string uciMove;
+    while(openingMoves >> uciMove) apply(uciMove);
+
+    EngineProcess engines[2] = {{0, -1, ""}, {0, -1, ""}};
+    string result;
+    while(result.empty()) {
+        if(legalMoves(boardState, team).empty()) {
+            bool mated = inCheck(boardState, team);
+            result = !mated ? "1/2-1/2" : team ? "0-1" : "1-0";
+            termination = mated ? "checkmate" : "stalemate";
+        } else if(count(keys.begin(), keys.end(), keys.back()) >= 3) {
+            result = "1/2-1/2";
+            termination = "threefold repetition";
+        } else if(keys.size() > 100) {
+            result = "1/2-1/2";
+            termination = "fifty moves";
+        } else if(insufficientMaterial(boardState)) {
+            result = "1/2-1/2";
+            termination = "insufficient material";
+        } else if(played.size() >= MAX_GAME_PLIES) {
+            result = "1/2-1/2";
+            termination = "adjudicated after " + to_string(MAX_GAME_PLIES) + " plies";
+        }
+        if(!result.empty()) break;
+
+        // the engine to move, started on its first turn with the game so far
+        int side = team == firstWhite ? 0 : 1;
+        EngineProcess& engine = engines[side];
+        bool ok = engine.pid > 0 ? sendLine(engine.fd, played.back()) : startEngine(engine, match.engines[side], played);
+
+        uint64_t nodes;
+        long long milliseconds;
+        ok = ok && engineMove(engine, uciMove, nodes, milliseconds);
+        if(ok) {
+            try {
+                apply(uciMove);
+            } catch(runtime_error& e) {
+                ok = false;
             }
         }
-    }
-    simulateMove(boardState, currI, currJ, tempMove);
-
-    printBoard(boardState);
+        if(!ok) {
+            // a crash, a hang or an illegal move loses the game
+            result = team ? "0-1" : "1-0";
+            termination = "forfeit by engine " + to_string(side + 1);
+            break;
+        }
 
-    auto time_span = duration_cast<duration<double>>(high_resolution_clock::now() - begin);
+        pthread_mutex_lock(&match.lock);
+        match.nodes[side] += nodes;
+        match.milliseconds[side] += milliseconds;
+        pthread_mutex_unlock(&match.lock);
+    }
 
-    std::cerr << endl << ntasks << " Total Threads: " << time_span.count() << '\n';
+    stopEngine(engines[0]);
+    stopEngine(engines[1]);
+    pgnMoves = moveText.str() + result;
+    return result;
+}
 
+// win probability model used for the elo estimate and the sprt
+double eloToScore(double elo) {
+    return 1 / (1 + pow(10, -elo / 400));
+}
 
-    return 0;
+double scoreToElo(double score) {
+    score = min(max(score, 1e-6), 1 - 1e-6);
+    return -400 * log10(1 / score - 1);
 }
 
-pair<int, string> minimax(vector<vector<Piece>> boardState, int depth, bool team, string bestMove, int alpha, int beta) {
-    // Base case: when the depth limit is reached, evaluate the board
-    if(depth == 4) {
-        return make_pair(evaluateScore(boardState, team), bestMove);
-    }
+// sprt of elo 0 against elo 5 at 5% error both ways, from the trinomial normal approximation
+double matchLLR(MatchState& match) {
+    int n = match.wins + match.losses + match.draws;
+    if(n == 0) return 0;
+    double score = (match.wins + match.draws / 2.0) / n;
+    double variance = (match.wins * pow(1 - score, 2) + match.draws * pow(0.5 - score, 2) + match.losses * pow(score, 2)) / n;
+    if(variance <= 0) return 0;
+    double s0 = eloToScore(0), s1 = eloToScore(5);
+    return n * (s1 - s0) * (2 * score - s0 - s1) / (2 * variance);
+}
 
-    vector<vector<Piece>> copyState;
-    int bestScore = team ? -INT_MAX : INT_MAX;
+const double SPRT_BOUND = log(0.95 / 0.05);
+
+void* playMatchGames(void* arg) {
+    MatchState& match = *(MatchState*)arg;
+    while(true) {
+        pthread_mutex_lock(&match.lock);
+        int game = match.nextGame++;
+        bool done = game >= match.games || match.stopped;
+        pthread_mutex_unlock(&match.lock);
+        if(done) break;
+
+        // each opening is played by both engines as white, one after the other
+        string& opening = match.openings[game / 2 % match.openings.size()];
+        bool firstWhite = game % 2 == 0;
+        string moves, termination;
+        string result = playMatchGame(match, opening, firstWhite, moves, termination);
+
+        pthread_mutex_lock(&match.lock);
+        bool firstWon = result == (firstWhite ? "1-0" : "0-1");
+        bool firstLost = result == (firstWhite ? "0-1" : "1-0");
+        match.wins += firstWon;
+        match.losses += firstLost;
+        match.draws += !firstWon && !firstLost;
+        ++match.played;
+
+        if(match.pgn.is_open()) {
+            string names[2] = {"engine 1: " + match.engines[0], "engine 2: " + match.engines[1]};
+            match.pgn << "[Event \"Self-play\"]\n[Site \"?\"]\n[Date \"????.??.??\"]\n[Round \"" << game + 1 << "\"]\n"
+                      << "[White \"" << names[!firstWhite] << "\"]\n[Black \"" << names[firstWhite] << "\"]\n"
+                      << "[Result \"" << result << "\"]\n[Termination \"" << termination << "\"]\n\n"
+                      << moves << "\n\n" << flush;
+        }
 
-    for(int i = 0; i < 8; ++i) {
-        for(int j = 0; j < 8; ++j) {
-            if(boardState[i][j].name != '-') {
-                boardState[i][j].possibleMove = possibleMoves(boardState, i, j);
+        cerr << "game " << game + 1 << ": " << (firstWhite ? "1-2 " : "2-1 ") << result << " (" << termination << "), "
+             << match.wins << "-" << match.losses << "-" << match.draws << endl;
 
-                if(boardState[i][j].color == team) {
-                    for(auto& move : boardState[i][j].possibleMove) {
-                        copyState = boardState;
-                        simulateMove(copyState, i, j, move);
-                        //cout << move << endl;
+        // a decided sprt needs no more games
+        double llr = matchLLR(match);
+        if(llr >= SPRT_BOUND || llr <= -SPRT_BOUND) match.stopped = true;
+        pthread_mutex_unlock(&match.lock);
+    }
+    return NULL;
+}
 
-                        // printBoard(copyState);
-                        int tempScore = minimax(copyState, depth + 1, !team, bestMove, alpha, beta).first;
+void runMatch(vector<string>& engines, int games, int concurrency, string& openingsPath, string& pgnPath) {
+    MatchState match;
+    match.engines = engines;
+    match.games = games;
+    match.nextGame = match.played = 0;
+    match.wins = match.losses = match.draws = 0;
+    match.nodes[0] = match.nodes[1] = 0;
+    match.milliseconds[0] = match.milliseconds[1] = 0;
+    match.stopped = false;
+    pthread_mutex_init(&match.lock, NULL);
+
+    if(openingsPath.empty()) match.openings = defaultOpenings;
+    else {
+        ifstream in(openingsPath);
+        if(!in) throw runtime_error("Cannot open openings " + openingsPath);
+        string line;
+        while(getline(in, line)) {
+            if(line.find_first_not_of(" \t\r") != string::npos) match.openings.push_back(line);
+        }
+        if(match.openings.empty()) throw runtime_error("No openings in " + openingsPath);
+    }
+    if(!pgnPath.empty()) {
+        match.pgn.open(pgnPath);
+        if(!match.pgn) throw runtime_error("Cannot write " + pgnPath);
+    }
 
-                        //cout << "Score   " << temp << endl;
+    vector<pthread_t> threads(max(concurrency, 1));
+    for(auto& thread : threads) {
+        if(::pthread_create(&thread, nullptr, playMatchGames, &match) != 0) {
+            ::perror("thread create");
+            return;
+        }
+    }
+    for(auto& thread : threads) pthread_join(thread, nullptr);
+
+    // elo of engine 1 against engine 2, with a 95% interval from the per game score spread
+    int n = match.played;
+    if(n == 0) return;
+    double score = (match.wins + match.draws / 2.0) / n;
+    double deviation = sqrt((match.wins * pow(1 - score, 2) + match.draws * pow(0.5 - score, 2) + match.losses * pow(score, 2)) / n / n);
+    double elo = scoreToElo(score);
+    double margin = (scoreToElo(score + 1.96 * deviation) - scoreToElo(score - 1.96 * deviation)) / 2;
+    double llr = matchLLR(match);
+
+    cout << "engine 1: " << engines[0] << endl;
+    cout << "engine 2: " << engines[1] << endl;
+    cout << "games " << n << ", engine 1 " << match.wins << " wins " << match.losses << " losses " << match.draws << " draws, score " << fixed << setprecision(3) << score << endl;
+    cout << "elo " << setprecision(1) << elo << " +/- " << margin << endl;
+    for(int e = 0; e < 2; ++e) {
+        cout << "engine " << e + 1 << " nps " << match.nodes[e] * 1000 / max(match.milliseconds[e], 1LL) << endl;
+    }
+    cout << "sprt elo0 0 elo1 5 alpha 0.05 beta 0.05: llr " << setprecision(2) << llr << " (" << -SPRT_BOUND << ", " << SPRT_BOUND << ") "
+         << (llr >= SPRT_BOUND ? "H1 accepted" : llr <= -SPRT_BOUND ? "H0 accepted" : "inconclusive") << endl;
+}
 
-                        if (team) { // Max
-                            if (tempScore > bestScore) {
-                                bestScore = tempScore;
-                                bestMove = to_string(i) + to_string(j) + move;
-                            }
-                            // tracks best possible score
-                            alpha = max(alpha, bestScore);
-                        } else { // Mini
-                            if (tempScore < bestScore) {
-                                bestScore = tempScore;
-                                bestMove = to_string(i) + to_string(j) + move;
-                            }
-                            // tracks worst possible score
-                            beta = min(beta, bestScore);
-                        }
-                        // since the beta route is chosen by the opponent, this wont actually be able to run
-                        // so we prune
-                        if (alpha >= beta) {
-                            break;
-                        }
+// the coordinator's side of a --serve connection
+// a stop is acted on as soon as it is read, tasks wait here for the serving thread
+struct ServeConnection {
+    int fd;
+    string buffer;
+    queue<string> tasks;
+    bool closed;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+};
 
-                    }
-                }
-            }
+void* readCoordinator(void* arg) {
+    ServeConnection& connection = *(ServeConnection*)arg;
+    string line;
+    while(readLine(connection.fd, connection.buffer, line, -1) > 0) {
+        if(line == "stop") {
+            stopSearch.store(true);
+            continue;
         }
+        // the next task only comes after the last answer, a stop behind it in the stream is for it
+        stopSearch.store(false);
+        pthread_mutex_lock(&connection.lock);
+        connection.tasks.push(line);
+        pthread_cond_signal(&connection.ready);
+        pthread_mutex_unlock(&connection.lock);
     }
 
-    return make_pair(bestScore, bestMove); // Return the best score found
+    // nobody is waiting for the answer any more
+    pthread_mutex_lock(&connection.lock);
+    connection.closed = true;
+    stopSearch.store(true);
+    pthread_cond_signal(&connection.ready);
+    pthread_mutex_unlock(&connection.lock);
+    return NULL;
 }
 
-bool inCheck(vector<vector<Piece>>& boardState, bool team) {
-    // find position of king for team
-
-    int kingI = -1;
-    int kingJ = -1;
+// --serve: search root tasks for a coordinator, one connection and one task at a time
+// start one process per core, they each keep their own transposition table between tasks
+void serveSearches(string& address) {
+    int listener = openSocket(address, true);
+    cerr << "serving searches on " << address << endl;
+
+    Board boardState;
+    while(true) {
+        int fd = accept(listener, NULL, NULL);
+        if(fd < 0) continue;
+        cerr << "coordinator connected" << endl;
+
+        ServeConnection connection;
+        connection.fd = fd;
+        connection.closed = false;
+        pthread_mutex_init(&connection.lock, NULL);
+        pthread_cond_init(&connection.ready, NULL);
+        pthread_t reader;
+        if(::pthread_create(&reader, nullptr, readCoordinator, &connection) != 0) {
+            ::perror("thread create");
+            close(fd);
+            continue;
+        }
 
-    for(int i = 0; i < 8; ++i) {
-        for(int j = 0; j < 8; ++j) {
-            if(boardState[i][j].name == 'K' && boardState[i][j].color == team) {
-                kingI = i;
-                kingJ = j;
+        while(true) {
+            pthread_mutex_lock(&connection.lock);
+            while(connection.tasks.empty() && !connection.closed) {
+                pthread_cond_wait(&connection.ready, &connection.lock);
+            }
+            if(connection.tasks.empty()) {
+                pthread_mutex_unlock(&connection.lock);
                 break;
             }
+            string line = connection.tasks.front();
+            connection.tasks.pop();
+            pthread_mutex_unlock(&connection.lock);
+
+            stringstream request(line);
+            string kind, encoded;
+            Task task;
+            size_t keyCount;
+            // the repetition check walks back halfmove keys, and no more than 100 plies are ever kept
+            bool valid = (request >> kind >> task.depth >> task.team >> task.halfmove >> task.move >> encoded >> keyCount)
+                && kind == "task" && task.depth >= 1 && task.depth < MAX_PLY
+                && keyCount >= 1 && keyCount <= 101 && task.halfmove >= 0 && (size_t)task.halfmove <= keyCount;
+            if(valid) {
+                gameKeys.resize(keyCount);
+                request >> hex;
+                for(auto& key : gameKeys) request >> key;
+                valid = !request.fail() && decodeBoard(encoded, boardState);
+            }
+            if(!valid) {
+                cerr << "bad task: " << line << endl;
+                break;
+            }
+            task.boardState = boardState;
+
+            // a depth 1 task is the start of a new search at the coordinator
+            if(task.depth == 1) ++ttGeneration;
+            // the coordinator keeps the bound, the task is searched with a full window here
+            rootBound.store(task.team ? INT_MAX : -INT_MAX);
+            results.clear();
+            searchNodes.store(0);
+
+            pthread_mutex_lock(&queueLock);
+            taskQueue.push(task);
+            pendingTasks = 1;
+            pthread_cond_broadcast(&queueReady);
+            while(pendingTasks > 0) {
+                pthread_cond_wait(&tasksDone, &queueLock);
+            }
+            pthread_mutex_unlock(&queueLock);
+
+            stringstream reply;
+            if(results.empty()) reply << "aborted " << searchNodes.load();
+            else {
+                Result& result = results[0];
+                reply << "result " << result.score << " " << searchNodes.load() << " " << (result.reply.empty() ? "-" : result.reply);
+                for(auto& pvMove : result.pv) reply << " " << pvMove;
+            }
+            if(!sendLine(fd, reply.str())) break;
         }
+
+        // wakes the reader if we are the ones giving up on the connection
+        shutdown(fd, SHUT_RDWR);
+        pthread_join(reader, nullptr);
+        close(fd);
+        pthread_mutex_destroy(&connection.lock);
+        pthread_cond_destroy(&connection.ready);
+        cerr << "coordinator disconnected" << endl;
+        // a worker only stops by being killed, so its table is kept after every coordinator
+        if(!ttFile.empty()) saveTT(ttFile);
     }
+}
 
-    if (kingI == -1 || kingJ == -1) return false;
 
-    for(int i = 0; i < 8; ++i) {
-        for(int j = 0; j < 8; ++j) {
-            if(boardState[i][j].name != '-') {
-                boardState[i][j].possibleMove = possibleMoves(boardState, i, j);
-            }
+// --listen: a long lived analysis server, one request per line from any number of clients
+//   analyze [id ID] [depth N] [movetime MS] [multipv N] [nodes N] [moves MOVE...]
+//   stop    ends this client's running search, it still gets its result
+// answered with one json object per line:
+//   {"id":"a","status":"queued","ahead":0}       admitted, searches waiting in front of it
+//   {"id":"a","depth":3,"multipv":1,"cp":30,"nodes":...,"nps":...,"time":...,"pv":[...]}  every iteration
+//   {"id":"a","bestmove":"b1c3","ponder":"b8c6","depth":5,"nodes":...,"time":...}   the end of it, time since it arrived
+//   {"id":"a","error":"..."}                      refused or failed
+// the movetime of a request is its deadline, counted from when it arrives, time in the queue included
+// requests run one after the other on the whole thread pool, so the table carries over between them;
+// the earliest deadline goes first, requests without one after those in arrival order, and a search
+// only gets its even share of the time the deadlines waiting behind it leave (a request arriving
+// mid-search is only counted from the next pick). one whose deadline passed in the queue still gets
+// a depth 1 answer marked "late". a full queue turns new requests away
+// SIGINT/SIGTERM stop the running search, refuse what is queued, then --hash-file is saved on the way out
+
+struct AnalysisClient {
+    int fd;
+    string buffer;
+    // the connection is gone, its queued requests are dropped
+    atomic<bool> closed;
+    // the reader and the searching thread both answer
+    pthread_mutex_t writeLock;
+
+    AnalysisClient(int socket) : fd(socket), closed(false) { pthread_mutex_init(&writeLock, NULL); }
+    ~AnalysisClient() {
+        close(fd);
+        pthread_mutex_destroy(&writeLock);
+    }
+};
+
+struct AnalysisRequest {
+    shared_ptr<AnalysisClient> client;
+    string id;
+    vector<string> moves;
+    int depth;
+    int moveTime;
+    int multiPV;
+    uint64_t nodes;
+    high_resolution_clock::time_point arrived;
+};
+
+// waiting requests, oldest first, guarded by requestLock
+deque<AnalysisRequest> requestQueue;
+size_t requestLimit = 16;
+// the server's command line limits, for whatever a request leaves out
+AnalysisRequest requestDefaults;
+pthread_mutex_t requestLock;
+pthread_cond_t requestReady;
+// whose request is being searched, a stop or a hang up from them ends it
+AnalysisClient* activeClient = nullptr;
+// set by SIGINT/SIGTERM, the dispatch loop notices it within signalPoll
+volatile sig_atomic_t serverStopping = 0;
+
+string jsonString(const string& text) {
+    string quoted = "\"";
+    for(char c : text) {
+        if(c == '"' || c == '\\') quoted += '\\';
+        if((unsigned char)c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            quoted += escaped;
         }
+        else quoted += c;
     }
+    return quoted + "\"";
+}
 
-    string kingPos = to_string(kingI) + to_string(kingJ);
+// "cp":N or "mate":N from the side to move's view, like uciScore
+string jsonScore(int score, bool team) {
+    string uci = uciScore(score, team);
+    size_t space = uci.find(' ');
+    return jsonString(uci.substr(0, space)) + ":" + uci.substr(space + 1);
+}
 
-    for(int i = 0; i < 8; ++i) {
-        for(int j = 0; j < 8; ++j) {
-            if(boardState[i][j].color != team) {
-                for(auto& x : boardState[i][j].possibleMove) {
-                    if (x == kingPos) return true;
+bool sendClient(AnalysisClient& client, const string& line) {
+    if(client.closed) return false;
+    pthread_mutex_lock(&client.writeLock);
+    bool sent = sendLine(client.fd, line);
+    pthread_mutex_unlock(&client.writeLock);
+    if(!sent) client.closed = true;
+    return sent;
+}
+
+// fills in what the request line asks for, the server's own limits stay for the rest
+bool parseRequest(string& line, AnalysisRequest& request, string& error) {
+    stringstream words(line);
+    string word;
+    words >> word;
+    if(word != "analyze") {
+        error = "unknown command " + word;
+        return false;
+    }
+    while(words >> word) {
+        if(word == "moves") {
+            while(words >> word) {
+                if(!isMoveString(word)) {
+                    error = "bad move " + word;
+                    return false;
                 }
+                request.moves.push_back(word);
+            }
+            break;
+        }
+        string value;
+        if(!(words >> value)) {
+            error = "missing value for " + word;
+            return false;
+        }
+        try {
+            if(word == "id") request.id = value;
+            else if(word == "depth") request.depth = stoi(value);
+            else if(word == "movetime") request.moveTime = stoi(value);
+            else if(word == "multipv") request.multiPV = stoi(value);
+            else if(word == "nodes") request.nodes = stoull(value);
+            else {
+                error = "unknown field " + word;
+                return false;
             }
+        } catch(exception&) {
+            error = "bad value for " + word;
+            return false;
         }
     }
-
-    return false;
+    if(request.depth < 1 || request.depth >= MAX_PLY) error = "depth must be 1 to " + to_string(MAX_PLY - 1);
+    else if(request.moveTime < 0) error = "movetime must not be negative";
+    else if(request.multiPV < 1) error = "multipv must be at least 1";
+    return error.empty();
 }
 
+// one per connection: admits its requests into the queue and acts on stops
+void* readClient(void* arg) {
+    shared_ptr<AnalysisClient> client = *(shared_ptr<AnalysisClient>*)arg;
+    delete (shared_ptr<AnalysisClient>*)arg;
+
+    string line;
+    while(readLine(client->fd, client->buffer, line, -1) > 0) {
+        if(line.empty()) continue;
+        if(line == "stop") {
+            pthread_mutex_lock(&requestLock);
+            if(activeClient == client.get()) stopSearch.store(true);
+            pthread_mutex_unlock(&requestLock);
+            continue;
+        }
 
-int evaluateScore(vector<vector<Piece>>& boardState, bool team) {
+        AnalysisRequest request = requestDefaults;
+        request.client = client;
+        request.arrived = high_resolution_clock::now();
+        string error;
+        if(!parseRequest(line, request, error)) {
+            sendClient(*client, "{\"id\":" + jsonString(request.id) + ",\"error\":" + jsonString(error) + "}");
+            continue;
+        }
 
-    // used ai for the scoring tables
-    // only effective for midgame
+        // admission control: a full queue answers right away instead of letting the client wait
+        pthread_mutex_lock(&requestLock);
+        size_t ahead = requestQueue.size() + (activeClient != nullptr);
+        bool admitted = requestQueue.size() < requestLimit;
+        if(admitted) {
+            requestQueue.push_back(request);
+            pthread_cond_signal(&requestReady);
+        }
+        pthread_mutex_unlock(&requestLock);
+        if(admitted) sendClient(*client, "{\"id\":" + jsonString(request.id) + ",\"status\":\"queued\",\"ahead\":" + to_string(ahead) + "}");
+        else sendClient(*client, "{\"id\":" + jsonString(request.id) + ",\"error\":\"queue full\"}");
+    }
 
-    int pawnTable[8][8] = {
-        {  0,  5,  5, -10, -10,  5,  5,  0 },
-        {  0, 10, 10,   0,   0, 10, 10,  0 },
-        {  0, 10, 20,  30,  30, 20, 10,  0 },
-        {  0, 10, 10,  20,  20, 10, 10,  0 },
-        {  0, 10, 10,  20,  20, 10, 10,  0 },
-        {  0, 10, 10,   0,   0, 10, 10,  0 },
-        {  0,  5,  5, -10, -10,  5,  5,  0 },
-        {  0,  0,  0,   0,   0,  0,  0,  0 }
-    };
+    // nobody is left to read the answer
+    pthread_mutex_lock(&requestLock);
+    client->closed = true;
+    if(activeClient == client.get()) stopSearch.store(true);
+    pthread_mutex_unlock(&requestLock);
+    return NULL;
+}
 
-    int knightTable[8][8] = {
-        { -50, -40, -30, -30, -30, -30, -40, -50 },
-        { -40, -20,   0,   0,   0,   0, -20, -40 },
-        { -30,   0,  10,  15,  15,  10,   0, -30 },
-        { -30,   5,  15,  20,  20,  15,   5, -30 },
-        { -30,   0,  15,  20,  20,  15,   0, -30 },
-        { -30,   5,  10,  15,  15,  10,   5, -30 },
-        { -40, -20,   0,   5,   5,   0, -20, -40 },
-        { -50, -40, -30, -30, -30, -30, -40, -50 }
-    };
+void* acceptClients(void* arg) {
+    int listener = *(int*)arg;
+    while(!serverStopping) {
+        int fd = accept(listener, NULL, NULL);
+        if(fd < 0) continue;
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        shared_ptr<AnalysisClient>* client = new shared_ptr<AnalysisClient>(make_shared<AnalysisClient>(fd));
+        pthread_t reader;
+        if(::pthread_create(&reader, nullptr, readClient, client) != 0) {
+            ::perror("thread create");
+            delete client;
+            continue;
+        }
+        pthread_detach(reader);
+    }
+    return NULL;
+}
 
-    int bishopTable[8][8] = {
-        { -20, -10, -10, -10, -10, -10, -10, -20 },
-        { -10,   5,   0,   0,   0,   0,   5, -10 },
-        { -10,  10,  10,  10,  10,  10,  10, -10 },
-        { -10,   0,  10,  10,  10,  10,   0, -10 },
-        { -10,   5,   5,  10,  10,   5,   5, -10 },
-        { -10,   0,   5,  10,  10,   5,   0, -10 },
-        { -10,   0,   0,   0,   0,   0,   0, -10 },
-        { -20, -10, -10, -10, -10, -10, -10, -20 }
-    };
+high_resolution_clock::time_point requestDeadline(AnalysisRequest& request) {
+    if(request.moveTime == 0) return high_resolution_clock::time_point::max();
+    return request.arrived + std::chrono::milliseconds(request.moveTime);
+}
 
-    int rookTable[8][8] = {
-        {  0,   0,   0,   5,   5,   0,   0,   0 },
-        {  0,   0,   0,   5,   5,   0,   0,   0 },
-        {  0,   0,   0,   5,   5,   0,   0,   0 },
-        {  5,   5,   5,  10,  10,   5,   5,   5 },
-        {  5,   5,   5,  10,  10,   5,   5,   5 },
-        {  0,   0,   0,   5,   5,   0,   0,   0 },
-        {  0,   0,   0,   5,   5,   0,   0,   0 },
-        {  0,   0,   0,   0,   0,   0,   0,   0 }
-    };
+// milliseconds the request at the front may search, 0 for no limit and -1 once its deadline passed
+// the k-th deadline still waiting leaves it at most 1/(k+1) of the time until then, so a burst of
+// short deadlines behind a long one is shared out instead of all missing. guarded by requestLock
+long long requestBudget(AnalysisRequest& request) {
+    auto now = high_resolution_clock::now();
+    long long budget = 0;
+    if(request.moveTime > 0) {
+        budget = duration_cast<std::chrono::milliseconds>(requestDeadline(request) - now).count();
+        if(budget <= 0) return -1;
+    }
 
-    int queenTable[8][8] = {
-        { -20, -10, -10,  -5,  -5, -10, -10, -20 },
-        { -10,   0,   0,   0,   0,   0,   0, -10 },
-        { -10,   0,   5,   5,   5,   5,   0, -10 },
-        {  -5,   0,   5,   5,   5,   5,   0,  -5 },
-        {   0,   0,   5,   5,   5,   5,   0,  -5 },
-        { -10,   5,   5,   5,   5,   5,   0, -10 },
-        { -10,   0,   5,   0,   0,   0,   0, -10 },
-        { -20, -10, -10,  -5,  -5, -10, -10, -20 }
-    };
+    vector<high_resolution_clock::time_point> waiting;
+    for(auto& queued : requestQueue) {
+        if(queued.moveTime > 0 && !queued.client->closed) waiting.push_back(requestDeadline(queued));
+    }
+    sort(waiting.begin(), waiting.end());
+    for(size_t k = 0; k < waiting.size(); ++k) {
+        long long share = duration_cast<std::chrono::milliseconds>(waiting[k] - now).count() / (long long)(k + 2);
+        share = max(share, 1LL);
+        budget = budget == 0 ? share : min(budget, share);
+    }
+    return budget;
+}
 
-    int kingTable[8][8] = {
-        { -30, -40, -40, -50, -50, -40, -40, -30 },
-        { -30, -40, -40, -50, -50, -40, -40, -30 },
-        { -30, -40, -40, -50, -50, -40, -40, -30 },
-        { -30, -40, -40, -50, -50, -40, -40, -30 },
-        { -20, -30, -30, -40, -40, -30, -30, -20 },
-        { -10, -20, -20, -20, -20, -20, -20, -10 },
-        {  20,  20,   0,   0,   0,   0,  20,  20 },
-        {  20,  30,  10,   0,   0,  10,  30,  20 }
-    };
+// searches one request on the pool with the time requestBudget gave it, the other limits are the request's
+void runRequest(AnalysisRequest& request, long long budget) {
+    AnalysisClient& client = *request.client;
+    string id = "{\"id\":" + jsonString(request.id);
+    bool late = budget < 0;
 
+    Board boardState;
+    initialBoard(boardState);
+    gameKeys.assign(1, hashBoard(boardState, true));
+    bool team = true;
+    try {
+        for(auto& move : request.moves) {
+            playMove(boardState, move, team);
+            team = !team;
+        }
+    } catch(runtime_error& e) {
+        sendClient(client, id + ",\"error\":" + jsonString(e.what()) + "}");
+        return;
+    }
 
-    int score = 0;
-    for (int i = 0; i < 8; ++i) {
-        for (int j = 0; j < 8; ++j) {
-            if (boardState[i][j].name == '-') {
-                continue;
+    int savedDepth = maxDepth, savedTime = moveTime, savedPV = multiPV;
+    uint64_t savedNodes = nodeLimit;
+    // too late for the search it asked for, the quickest legal answer is still worth more than none
+    maxDepth = late ? 1 : request.depth;
+    moveTime = late ? 0 : budget;
+    multiPV = request.multiPV;
+    nodeLimit = request.nodes;
+
+    SearchResult result = searchPosition(boardState, team, false, [&](SearchResult& iteration, uint64_t nodes, long long elapsed) {
+        // a signal before the search reset stopSearch is caught here, one iteration later
+        if(serverStopping) stopSearch.store(true);
+        for(size_t k = 0; k < iteration.lines.size(); ++k) {
+            stringstream info;
+            info << id << ",\"depth\":" << iteration.depth << ",\"multipv\":" << k + 1
+                 << "," << jsonScore(iteration.lines[k].score, team) << ",\"nodes\":" << nodes
+                 << ",\"nps\":" << nodes * 1000 / max(elapsed, 1LL) << ",\"time\":" << elapsed << ",\"pv\":[";
+            for(size_t m = 0; m < iteration.lines[k].pv.size(); ++m) {
+                info << (m ? "," : "") << jsonString(convertToUCI(iteration.lines[k].pv[m]));
             }
+            info << "]}";
+            sendClient(client, info.str());
+        }
+    });
+
+    maxDepth = savedDepth;
+    moveTime = savedTime;
+    multiPV = savedPV;
+    nodeLimit = savedNodes;
+
+    stringstream done;
+    done << id << ",\"bestmove\":" << (result.move.empty() ? "null" : jsonString(convertToUCI(result.move)));
+    if(!result.reply.empty()) done << ",\"ponder\":" << jsonString(convertToUCI(result.reply));
+    done << ",\"depth\":" << result.depth << ",\"nodes\":" << searchNodes.load() << ",\"time\":"
+         << duration_cast<std::chrono::milliseconds>(high_resolution_clock::now() - request.arrived).count();
+    if(late) done << ",\"late\":true";
+    done << "}";
+    sendClient(client, done.str());
+}
 
-            int pieceValue = 0;
+void handleServerSignal(int sig) {
+    // a second signal kills the process the usual way
+    serverStopping = 1;
+    stopSearch.store(true);
+    signal(sig, SIG_DFL);
+}
 
-            if (boardState[i][j].name == 'K') pieceValue = 100 + kingTable[i][j];
-            else if (boardState[i][j].name == 'Q') pieceValue = 9 + queenTable[i][j];
-            else if (boardState[i][j].name == 'B') pieceValue = 3 + bishopTable[i][j];
-            else if (boardState[i][j].name == 'R') pieceValue = 3 + rookTable[i][j];
-            else if (boardState[i][j].name == 'N') pieceValue = 5 + knightTable[i][j];
-            else if (boardState[i][j].name == 'P') pieceValue = 1 + pawnTable[i][j];
+// --listen: takes requests from every client and searches them one at a time, until a signal
+void serveAnalysis(string& address, int queueLimit) {
+    requestLimit = queueLimit;
+    requestDefaults.depth = maxDepth;
+    requestDefaults.moveTime = moveTime;
+    requestDefaults.multiPV = multiPV;
+    requestDefaults.nodes = nodeLimit;
+    pthread_mutex_init(&requestLock, NULL);
+    pthread_cond_init(&requestReady, NULL);
+
+    signal(SIGINT, handleServerSignal);
+    signal(SIGTERM, handleServerSignal);
+    int listener = openSocket(address, true);
+    pthread_t acceptor;
+    if(::pthread_create(&acceptor, nullptr, acceptClients, &listener) != 0) throw runtime_error("Cannot start the analysis server.");
+    cerr << "analysis server on " << address << ", up to " << requestLimit << " requests queued" << endl;
+
+    while(!serverStopping) {
+        pthread_mutex_lock(&requestLock);
+        while(requestQueue.empty() && !serverStopping) {
+            pollWait(requestReady, requestLock);
+        }
+        if(serverStopping) {
+            pthread_mutex_unlock(&requestLock);
+            break;
+        }
+        // earliest deadline first, the strict comparison keeps arrival order among equals
+        size_t pick = 0;
+        for(size_t r = 1; r < requestQueue.size(); ++r) {
+            if(requestDeadline(requestQueue[r]) < requestDeadline(requestQueue[pick])) pick = r;
+        }
+        AnalysisRequest request = requestQueue[pick];
+        requestQueue.erase(requestQueue.begin() + pick);
+        // a client that hung up while waiting gets nothing searched
+        if(request.client->closed) {
+            pthread_mutex_unlock(&requestLock);
+            continue;
+        }
+        long long budget = requestBudget(request);
+        activeClient = request.client.get();
+        pthread_mutex_unlock(&requestLock);
+
+        runRequest(request, budget);
+
+        pthread_mutex_lock(&requestLock);
+        activeClient = nullptr;
+        pthread_mutex_unlock(&requestLock);
+    }
+
+    // wakes the acceptor out of accept, readers are left to die with the process
+    shutdown(listener, SHUT_RDWR);
+    pthread_join(acceptor, nullptr);
+    close(listener);
+
+    pthread_mutex_lock(&requestLock);
+    for(auto& queued : requestQueue) {
+        sendClient(*queued.client, "{\"id\":" + jsonString(queued.id) + ",\"error\":\"server shutting down\"}");
+    }
+    requestQueue.clear();
+    pthread_mutex_unlock(&requestLock);
+
+    cerr << "analysis server stopped" << endl;
+}
+
+int main(int argc, char* argv[]) {
+
+    if(argc < 2) throw runtime_error("Please include number of threads in arguements.");
+
+    int ntasks = stoi(argv[1]);
+
+    // optional flags after the thread count
+    // --depth N      deepest iteration to search (plies, root move included)
+    // --movetime MS  stop the search after MS milliseconds
+    // --hash MB      transposition table size
+    // --ponder       keep playing, thinking on the opponent's time (see below)
+    // --book FILE    play from a Polyglot opening book while it has the position
+    // --book-keys FILE  781 hex numbers to use instead of the built-in Polyglot Random64 table
+    // --make-book FILE  write a book from games on stdin, one line of uci moves each
+    // --nnue FILE    evaluate with this network instead of the piece-square tables
+    // --multipv N    report the best N root moves with exact scores and their lines
+    // --serve ADDR   be a search worker for a coordinator, ADDR is a port, host:port or socket path
+    // --workers ADDR,ADDR...  also hand root moves to these --serve processes
+    // --listen ADDR  be an analysis server, json answers to requests from any number of clients
+    // --queue N      requests the analysis server keeps waiting before it turns new ones away
+    // --numa         pin search threads across numa nodes and interleave the table over them
+    // --hash-file FILE  start from the table saved in FILE, and save it there again on exit
+    // --game         keep playing after the move, reading the opponent's moves (--ponder does too)
+    // --nodes N      stop the search after N nodes
+    // --match GAMES --engine "OPTIONS" --engine "OPTIONS"  self-play, the thread count games at a time
+    // --openings FILE  one line of uci moves per opening for --match
+    // --pgn FILE     write the --match games here
+    int hashSize = 16;
+    bool ponderMode = false;
+    bool gameMode = false;
+    string bookPath, bookKeysPath, makeBookPath, nnuePath, servePath, workersList, listenPath;
+    int queueLimit = 16;
+    int matchGames = 0;
+    vector<string> matchEngines;
+    string openingsPath, pgnPath;
+    for(int a = 2; a < argc; ++a) {
+        string opt = argv[a];
+        if(opt == "--depth" && a + 1 < argc) maxDepth = stoi(argv[++a]);
+        else if(opt == "--movetime" && a + 1 < argc) moveTime = stoi(argv[++a]);
+        else if(opt == "--hash" && a + 1 < argc) hashSize = stoi(argv[++a]);
+        else if(opt == "--ponder") ponderMode = true;
+        else if(opt == "--game") gameMode = true;
+        else if(opt == "--nodes" && a + 1 < argc) nodeLimit = stoull(argv[++a]);
+        else if(opt == "--match" && a + 1 < argc) matchGames = stoi(argv[++a]);
+        else if(opt == "--engine" && a + 1 < argc) matchEngines.push_back(argv[++a]);
+        else if(opt == "--openings" && a + 1 < argc) openingsPath = argv[++a];
+        else if(opt == "--pgn" && a + 1 < argc) pgnPath = argv[++a];
+        else if(opt == "--book" && a + 1 < argc) bookPath = argv[++a];
+        else if(opt == "--book-keys" && a + 1 < argc) bookKeysPath = argv[++a];
+        else if(opt == "--make-book" && a + 1 < argc) makeBookPath = argv[++a];
+        else if(opt == "--nnue" && a + 1 < argc) nnuePath = argv[++a];
+        else if(opt == "--multipv" && a + 1 < argc) multiPV = stoi(argv[++a]);
+        else if(opt == "--serve" && a + 1 < argc) servePath = argv[++a];
+        else if(opt == "--workers" && a + 1 < argc) workersList = argv[++a];
+        else if(opt == "--listen" && a + 1 < argc) listenPath = argv[++a];
+        else if(opt == "--queue" && a + 1 < argc) queueLimit = stoi(argv[++a]);
+        else if(opt == "--numa") numaMode = true;
+        else if(opt == "--hash-file" && a + 1 < argc) ttFile = argv[++a];
+        else throw runtime_error("Unknown option " + opt);
+    }
+    if(maxDepth < 1) throw runtime_error("Depth must be at least 1.");
+    if(maxDepth >= MAX_PLY) throw runtime_error("Depth must be below " + to_string(MAX_PLY) + ".");
+    if(hashSize < 1) throw runtime_error("Hash size must be at least 1 MB.");
+    if(multiPV < 1) throw runtime_error("MultiPV must be at least 1.");
+    if(queueLimit < 1) throw runtime_error("Queue must hold at least 1 request.");
+
+    ios_base::sync_with_stdio(false);
+    cin.tie(NULL);
+
+    initZobrist();
+    initEval();
+    if(!nnuePath.empty()) loadNNUE(nnuePath);
+    initBookKeys();
+    if(!bookKeysPath.empty()) loadBookKeys(bookKeysPath);
+
+    if(!makeBookPath.empty()) {
+        makeBook(makeBookPath);
+        return 0;
+    }
+    if(!bookPath.empty() && !openBook(bookPath)) throw runtime_error("Cannot open book " + bookPath);
+
+    // the engines are their own processes, this one only referees
+    if(matchGames > 0) {
+        if(matchEngines.size() != 2) throw runtime_error("A match needs two --engine configurations.");
+        runMatch(matchEngines, matchGames, ntasks, openingsPath, pgnPath);
+        return 0;
+    }
+
+    if(numaMode) initNuma();
+    resizeTT(hashSize);
+    if(ttFile.empty() || !loadTT(ttFile)) touchTT(max(ntasks, 1));
+
+    pthread_mutex_init(&queueLock, NULL);
+    pthread_mutex_init(&resultsLock, NULL);
+    pthread_mutex_init(&commandLock, NULL);
+    pthread_cond_init(&queueReady, NULL);
+    pthread_cond_init(&tasksDone, NULL);
+    pthread_cond_init(&commandReady, NULL);
+
+    // the other processes are connected before any thread can take a task for them
+    stringstream workerAddresses(workersList);
+    string address;
+    while(getline(workerAddresses, address, ',')) {
+        if(address.empty()) continue;
+        int fd = openSocket(address, false);
+        if(fd < 0) throw runtime_error("Cannot reach worker " + address);
+        remoteWorkers.push_back({address, fd, ""});
+    }
+    if(ntasks + remoteWorkers.size() < 1) throw runtime_error("Need at least one thread or worker.");
+
+    // setup thread vector, local threads first and then one per remote worker
+    vector<pthread_t> threads(ntasks + remoteWorkers.size());
+
+    for(int i=0; i < (int)threads.size(); ++i) {
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if(numaMode && i < ntasks) numaAffinity(attr, i);
+        int status = i < ntasks ? ::pthread_create(&threads[i], &attr, worker, nullptr)
+                                : ::pthread_create(&threads[i], &attr, remoteWorker, &remoteWorkers[i - ntasks]);
+        pthread_attr_destroy(&attr);
+        if (status != 0) {
+            ::perror("thread create");
+            return 1;
+        }
+    }
+
+    // a worker process answers its coordinator until it is killed
+    if(!servePath.empty()) serveSearches(servePath);
+    if(!listenPath.empty()) {
+        serveAnalysis(listenPath, queueLimit);
+        releasePool(threads);
+        if(!ttFile.empty()) saveTT(ttFile);
+        return 0;
+    }
+
+    Board boardState;
+    initialBoard(boardState);
+    gameKeys.assign(1, hashBoard(boardState, true));
+
+    // Example input:
+
+    // The engine plays the side to move, white after an even number of moves
+    /*
+
+    Example Game vs Stockfish
+    Graph Generated on this Input
+    24
+    e2e4 e7e5 g1f3 b8c6 f1c4 g8f6 d2d3 f8c5 c2c3 d7d6 c4f7 e8f7 c3c4 f7e8 b1c3 h7h6 f3e5 d6e5 d1h5 f6h5 c3d5 c5f2 e1f2 h8f8
+    
+    4
+    e2e4 g8f6 e4e5 f6d5
+
+
+    With --game or --ponder the game continues after the move is printed, one command per line
+    each search carries on from the last one where the game followed its line
+    ponderhit   the opponent played the predicted reply
+    e7e5        the opponent's actual move (a miss unless it was the prediction)
+    stop        abandon pondering, the actual move follows
+    quit        exit
+
+    */
+
+    int numInput;
+    cin >> numInput;
+    vector<string> moveList(numInput);
+    for(auto& move : moveList) cin >> move;
+
+    playFirstMoves(boardState, moveList);
+    printBoard(boardState);
+
+    printPossibleMoves(boardState);
+
+
+    // a stop command on stdin or SIGINT/SIGTERM ends the search early
+    signal(SIGINT, handleStopSignal);
+    signal(SIGTERM, handleStopSignal);
+    pthread_t listener;
+    if (::pthread_create(&listener, nullptr, listenForCommands, nullptr) == 0) {
+        pthread_detach(listener);
+    }
+
+    // the engine plays whoever is to move after the input moves
+    bool team = moveList.size() % 2 == 0;
+
+    while(true) {
+        // Start a timer
+        high_resolution_clock::time_point begin = high_resolution_clock::now();
 
-            if (boardState[i][j].color == team) {
-                score += pieceValue;
-            } else {
-                score -= pieceValue;
+        // known openings come straight from the book
+        SearchResult result = {0, probeBook(boardState, team), "", 0, {}};
+        if(!result.move.empty()) cerr << "book move" << endl;
+        else result = searchPosition(boardState, team, false);
+        if(result.move.empty()) {
+            cout << "No moves available." << endl;
+            break;
+        }
+        playBestMove(boardState, result, begin, ntasks);
+
+        if(!ponderMode && !gameMode) break;
+
+        // ponder: search the position after the predicted reply until the opponent moves
+        // a hit turns the ponder search into the real one, keeping its iterations and the table
+        bool hit = ponderMode && !result.reply.empty();
+        while(hit) {
+            string predicted = convertToUCI(result.reply);
+            Board ponderState = boardState;
+            // the prediction goes into the game's history, taken back again on a miss
+            vector<uint64_t> playedKeys = gameKeys;
+            playMove(ponderState, predicted, !team);
+
+            // the opponent may already have answered while we were printing
+            pthread_mutex_lock(&commandLock);
+            ponderMove = predicted;
+            ponderHit = false;
+            if(!opponentMoves.empty()) {
+                string next = opponentMoves.front();
+                if(next == "ponderhit" || next == ponderMove) {
+                    opponentMoves.pop();
+                    ponderHit = true;
+                }
+            }
+            hit = !stopSignalled && (ponderHit || (opponentMoves.empty() && !quitRequested));
+            pondering = hit;
+            bool alreadyHit = ponderHit;
+            pthread_mutex_unlock(&commandLock);
+            if(!hit) {
+                gameKeys = playedKeys;
+                break;
+            }
+            cout << "ponder " << ponderMove << endl;
+
+            begin = high_resolution_clock::now();
+            SearchResult ponderResult = searchPosition(ponderState, team, !alreadyHit);
+
+            pthread_mutex_lock(&commandLock);
+            hit = ponderHit;
+            pondering = false;
+            pthread_mutex_unlock(&commandLock);
+
+            if(!hit || ponderResult.move.empty()) {
+                gameKeys = playedKeys;
+                break;
             }
+
+            boardState = ponderState;
+            result = ponderResult;
+            playBestMove(boardState, result, begin, ntasks);
+            hit = !result.reply.empty();
         }
+
+        // missed, or nothing to predict: wait for the move actually played
+        // a stale ponderhit has nothing to say about the actual move
+        string opponentMove;
+        pthread_mutex_lock(&commandLock);
+        while(opponentMove.empty()) {
+            while(opponentMoves.empty() && !quitRequested && !stopSignalled) {
+                pollWait(commandReady, commandLock);
+            }
+            if(opponentMoves.empty()) break;
+            if(opponentMoves.front() != "ponderhit") opponentMove = opponentMoves.front();
+            opponentMoves.pop();
+        }
+        pthread_mutex_unlock(&commandLock);
+        if(opponentMove.empty()) break;
+
+        playMove(boardState, opponentMove, !team);
     }
 
-    if (inCheck(boardState, team)) {
-        score -= 60; // Apply a large penalty if the king is in check
+    releasePool(threads);
+    if(!ttFile.empty()) saveTT(ttFile);
+
+    return 0;
+}
+
+SearchResult searchPosition(Board& boardState, bool team, bool ponder, IterationReport report) {
+    SearchResult best = {team ? -INT_MAX : INT_MAX, "", "", 0, {}};
+
+    // set up one task per legal move
+    // each task holds a new updated board state, and the move associated with that state
+    vector<Task> rootTasks;
+    for(auto& move : legalMoves(boardState, team)) {
+        Board boardStateCpy = boardState;
+        simulateMove(boardStateCpy, move);
+        Task toPush;
+        toPush.boardState = boardStateCpy;
+        toPush.move = move;
+        toPush.team = !team;
+        toPush.halfmove = isIrreversible(boardState, move) ? 0 : gameKeys.size();
+        rootTasks.push_back(toPush);
+    }
+    if(rootTasks.empty()) return best;
+
+    // the game went the way the last search said, its table entries already cover the
+    // first plies below here, so deepening starts where that line left off
+    // the line's move stands as a completed iteration of that depth, so a search stopped
+    // in its first iteration still answers with it instead of a partial result
+    int startDepth = 1;
+    if(hashBoard(boardState, team) == reuseKey && reuseDepth > 1) {
+        for(size_t i = 0; i < rootTasks.size(); ++i) {
+            if(rootTasks[i].move != reuseLine.move) continue;
+            // its move goes first, the one most likely to finish if time runs out
+            swap(rootTasks[0], rootTasks[i]);
+            startDepth = min(reuseDepth, maxDepth);
+            best = {reuseLine.score, reuseLine.move, reuseLine.reply, reuseDepth, {reuseLine}};
+            cerr << "continuing the last search from depth " << startDepth << endl;
+            break;
+        }
     }
 
-    // Check if the opponent's king is in check
-    if (inCheck(boardState, !team)) {
-        score += 60; // Apply a large reward if the opponent's king is in check
+    high_resolution_clock::time_point searchStart = high_resolution_clock::now();
+    searchNodes.store(0);
+
+    // a ponder search has no deadline until the opponent plays the predicted move
+    stopSearch.store(false);
+    timeLimited.store(false);
+    if(moveTime > 0 && !ponder) {
+        searchDeadline = high_resolution_clock::now() + std::chrono::milliseconds(moveTime);
+        timeLimited.store(true);
     }
+    ++ttGeneration;
 
-    return score;
+    // iterative deepening, the best move only changes once an iteration has fully finished
+    // so a stopped search still answers with the last completed depth
+    for(int depth = startDepth; depth <= maxDepth; ++depth) {
+        results.clear();
+        rootBound.store(team ? -INT_MAX : INT_MAX);
+
+        pthread_mutex_lock(&queueLock);
+        for(auto& task : rootTasks) {
+            task.depth = depth;
+            taskQueue.push(task);
+        }
+        pendingTasks = rootTasks.size();
+        pthread_cond_broadcast(&queueReady);
+
+        // Wait for all to finish
+        while(pendingTasks > 0) {
+            pthread_cond_wait(&tasksDone, &queueLock);
+        }
+        pthread_mutex_unlock(&queueLock);
+
+        // white wants the highest score, black the lowest
+        // with --multipv above 1 every root move had a full window, so each score is exact and the order is real
+        // otherwise the best score is exact and every move that failed low against it scores strictly worse
+        stable_sort(results.begin(), results.end(), [team](const Result& a, const Result& b) {
+            return team ? a.score > b.score : a.score < b.score;
+        });
+        SearchResult iteration = {team ? -INT_MAX : INT_MAX, "", "", depth, {}};
+        if(!results.empty()) {
+            iteration.score = results[0].score;
+            iteration.move = results[0].move;
+            iteration.reply = results[0].reply;
+            iteration.lines.assign(results.begin(), results.begin() + min((int)results.size(), multiPV));
+        }
+
+        if(stopSearch.load()) {
+            // nothing finished at all, take whatever the partial iteration found
+            if(best.move.empty()) best = iteration;
+            break;
+        }
+        best = iteration;
+
+        // the next iteration starts with the best move, its score narrows the window of the rest,
+        // then goes by last iteration's cost, most expensive first, so the last task to finish is a cheap one
+        unordered_map<string, uint64_t> cost;
+        for(auto& result : results) cost[result.move] = result.nodes;
+        stable_sort(rootTasks.begin(), rootTasks.end(), [&](const Task& a, const Task& b) {
+            if((a.move == best.move) != (b.move == best.move)) return a.move == best.move;
+            return cost[a.move] > cost[b.move];
+        });
+
+        // one uci info line per finished iteration, one per line with --multipv
+        uint64_t nodes = searchNodes.load();
+        long long elapsed = duration_cast<std::chrono::milliseconds>(high_resolution_clock::now() - searchStart).count();
+        if(report) {
+            report(best, nodes, elapsed);
+            continue;
+        }
+        for(size_t k = 0; k < best.lines.size(); ++k) {
+            cout << "info depth " << depth;
+            if(multiPV > 1) cout << " multipv " << k + 1;
+            cout << " score " << uciScore(best.lines[k].score, team) << " nodes " << nodes
+                 << " nps " << nodes * 1000 / max(elapsed, 1LL) << " time " << elapsed << " pv";
+            for(auto& move : best.lines[k].pv) cout << " " << convertToUCI(move);
+            cout << endl;
+        }
+    }
+
+    // stopped before any root move was searched
+    if(best.move.empty()) best.move = rootTasks[0].move;
+
+    // remember where the line goes, in case the opponent plays the reply
+    reuseKey = 0;
+    if(!best.lines.empty() && best.lines[0].pv.size() >= 2) {
+        vector<string>& pv = best.lines[0].pv;
+        Board expected = boardState;
+        simulateMove(expected, pv[0]);
+        simulateMove(expected, pv[1]);
+        reuseKey = hashBoard(expected, team);
+        reuseDepth = best.depth - 2;
+        reuseLine = {best.lines[0].score, pv.size() >= 3 ? pv[2] : "", pv.size() >= 4 ? pv[3] : "", vector<string>(pv.begin() + 2, pv.end()), 0};
+    }
+
+    // a finished ponder search must not answer before the opponent has moved
+    if(ponder) {
+        pthread_mutex_lock(&commandLock);
+        while(!ponderHit && !stopSearch.load() && !quitRequested && !stopSignalled) {
+            pollWait(commandReady, commandLock);
+        }
+        pthread_mutex_unlock(&commandLock);
+    }
+
+    return best;
 }
 
-void simulateMove(vector<vector<Piece>>& boardState, int i, int j, string& move) {
-    string endPos, convertedEndPos;
-    int currI, currJ, endI, endJ;
-    Piece currPiece;
+// scores are kept from white's side, uci wants the side to move's and mates in moves
+string uciScore(int score, bool team) {
+    if(!team) score = -score;
+    if(abs(score) > MATE_SCORE - MAX_PLY) {
+        int plies = MATE_SCORE - abs(score);
+        return "mate " + to_string(score > 0 ? (plies + 1) / 2 : -(plies + 1) / 2);
+    }
+    return "cp " + to_string(score);
+}
 
-    currI = i;
-    currJ = j;
-    endI = stoi(move.substr(0, 1));
-    endJ = stoi(move.substr(1, 1));
-    convertedEndPos = to_string(endI) + to_string(endJ); 
+void playBestMove(Board& boardState, SearchResult& result, high_resolution_clock::time_point begin, int ntasks) {
+    string bestMove = result.move;
 
-    if(boardState[currI][currJ].name != '-') {
-        boardState[i][j].possibleMove = possibleMoves(boardState, i, j);
-        for(auto& possibleMove : boardState[currI][currJ].possibleMove) {
-            if(possibleMove == convertedEndPos) {
-                if(boardState[endI][endJ].name == '-') {
-                    swap(boardState[currI][currJ], boardState[endI][endJ]);
+    cout << endl << endl << endl;
+    cout << endl << result.score << "  " << bestMove << endl;
+    cerr << "completed depth " << result.depth << endl;
 
-                }
+    string printMove = convertToUCI(bestMove);
 
-                else {
-                    boardState[endI][endJ].name = '-';
-                    boardState[endI][endJ].color = true;
-                    swap(boardState[currI][currJ], boardState[endI][endJ]);
-                }
+    cout << printMove << endl;
 
-                break;
+    recordMove(boardState, bestMove);
+
+    printBoard(boardState);
+
+    auto time_span = duration_cast<duration<double>>(high_resolution_clock::now() - begin);
+
+    std::cerr << endl << ntasks << " Total Threads: " << time_span.count() << '\n';
+}
+
+// move is the new best at ply, the line behind it is what the child just found
+void updatePV(int ply, string& move) {
+    pvTable[ply][ply] = move;
+    for(int p = ply + 1; p < pvLength[ply + 1]; ++p) pvTable[ply][p] = pvTable[ply + 1][p];
+    pvLength[ply] = max(pvLength[ply + 1], ply + 1);
+}
+
+template<Color Us>
+pair<int, string> minimax(Board& boardState, int depth, int maxDepth, string bestMove, int alpha, int beta) {
+    // one copy of the search per side, team and the max/min choice are compile-time constants
+    constexpr bool team = Us == WHITE;
+    constexpr Color Them = Us == WHITE ? BLACK : WHITE;
+
+    // bail out as soon as the search was stopped, the caller throws the score away
+    if(shouldStop()) {
+        return make_pair(0, bestMove);
+    }
+    ++nodeCount;
+    pvLength[depth] = depth;
+
+    uint64_t key = hashBoard(boardState, team);
+    if(isDraw(key, depth)) return make_pair(0, bestMove);
+
+    // a deep enough table entry settles the node without searching it
+    int remaining = maxDepth - depth;
+    int ttScore, ttDepth, ttBound;
+    string hashMove;
+    bool ttHit = probeTT(key, depth, ttScore, ttDepth, ttBound, hashMove);
+    if(ttHit && ttDepth >= remaining) {
+        if(ttBound == BOUND_EXACT
+            || (ttBound == BOUND_LOWER && ttScore >= beta)
+            || (ttBound == BOUND_UPPER && ttScore <= alpha)) {
+            return make_pair(ttScore, hashMove.empty() ? bestMove : hashMove);
+        }
+    }
+
+    // Base case: when the depth limit is reached, evaluate the board
+    // scores are always from white's side, white maximizes and black minimizes
+    if(depth >= maxDepth) {
+        int score = nnueEnabled ? nnueEvaluate(plyScratch[depth].accumulator, team) : evaluateScore<WHITE>(boardState);
+        storeTT(key, depth, score, 0, BOUND_EXACT, "");
+        return make_pair(score, bestMove);
+    }
+
+    int alphaStart = alpha;
+    int betaStart = beta;
+    // children are made in this ply's slot, the next ply uses the one after it
+    Board& copyState = plyScratch[depth].board;
+    int bestScore = team ? -INT_MAX : INT_MAX;
+    string nodeBest;
+
+    // a line still short enough may be extended, by one ply per move
+    bool extendable = maxDepth < 2 * taskDepth && maxDepth + 1 < MAX_PLY;
+
+    // puts the position after move into this ply's slot
+    auto makeChild = [&](string& move) {
+        plyScratch[depth + 1].halfmove = isIrreversible(boardState, move) ? 0 : plyScratch[depth].halfmove + 1;
+        plyScratch[depth + 1].captureSquare = isCapture(boardState, move) ? (move[2] - '0') * 8 + (move[3] - '0') : -1;
+        plyScratch[depth + 1].lastMove = moveIndex(boardState[move[0] - '0'][move[1] - '0'], move);
+        copyState = boardState;
+        simulateMove(copyState, move);
+        if(nnueEnabled) nnueUpdate(plyScratch[depth].accumulator, plyScratch[depth + 1].accumulator, boardState, move);
+    };
+
+    // singular extension: search everything but the hash move to half the depth with a null window
+    // just below the hash move's table score, if nothing reaches it the hash move is the only one
+    bool singular = false;
+    if(extendable && depth > 1 && remaining >= SINGULAR_DEPTH && ttHit && !hashMove.empty()
+        && ttDepth >= remaining - 3 && ttBound != (team ? BOUND_UPPER : BOUND_LOWER)
+        && abs(ttScore) < MATE_SCORE - MAX_PLY) {
+        int bound = team ? ttScore - SINGULAR_MARGIN * remaining : ttScore + SINGULAR_MARGIN * remaining;
+        MovePicker others;
+        initPicker(others, boardState, hashMove, depth);
+        others.moves = &plyScratch[depth].moves;
+        others.scratch = &plyScratch[depth].scratch;
+        others.bad = &plyScratch[depth].bad;
+        string move;
+        singular = true;
+        while(singular && nextMove<Us>(others, move)) {
+            if(move == hashMove) continue;
+            makeChild(move);
+            int score = team ? minimax<Them>(copyState, depth + 1, depth + remaining / 2, bestMove, bound - 1, bound).first
+                             : minimax<Them>(copyState, depth + 1, depth + remaining / 2, bestMove, bound, bound + 1).first;
+            if(team ? score >= bound : score <= bound) singular = false;
+        }
+        if(stopSearch.load(memory_order_relaxed)) singular = false;
+    }
+
+    auto searchMove = [&](string& move) {
+        // checks and recaptures on the square just captured on count only if they don't lose material,
+        // a pawn about to promote always does
+        int target = (move[2] - '0') * 8 + (move[3] - '0');
+        bool recapture = plyScratch[depth].captureSquare == target && isCapture(boardState, move);
+        bool pawnPush = boardState[move[0] - '0'][move[1] - '0'].name == 'P' && move[2] - '0' == (team ? 1 : 6);
+        makeChild(move);
+        int extension = 0;
+        if(extendable && ((singular && move == hashMove) || pawnPush || ((recapture || inCheck<Them>(copyState)) && see(boardState, move) >= 0))) extension = 1;
+
+        int tempScore = minimax<Them>(copyState, depth + 1, maxDepth + extension, bestMove, alpha, beta).first;
+
+        //cout << "Score   " << temp << endl;
+
+        if constexpr (team) { // Max
+            if (tempScore > bestScore) {
+                bestScore = tempScore;
+                bestMove = move;
+                nodeBest = bestMove;
+                updatePV(depth, move);
+            }
+            // tracks best possible score
+            alpha = max(alpha, bestScore);
+        } else { // Mini
+            if (tempScore < bestScore) {
+                bestScore = tempScore;
+                bestMove = move;
+                nodeBest = bestMove;
+                updatePV(depth, move);
             }
+            // tracks worst possible score
+            beta = min(beta, bestScore);
         }
+        // since the beta route is chosen by the opponent, this wont actually be able to run
+        // so we prune
+        return alpha >= beta;
+    };
+
+    // hash move, captures, killers, then the quiet moves, each generated only when reached
+    MovePicker picker;
+    initPicker(picker, boardState, hashMove, depth);
+    picker.moves = &plyScratch[depth].moves;
+    picker.scratch = &plyScratch[depth].scratch;
+    picker.bad = &plyScratch[depth].bad;
+    // one ply from the leaves nothing after the move can win the material back,
+    // so once a move was searched, captures and quiet moves that lose the exchange are skipped
+    bool frontier = remaining == 1 && !inCheck<Us>(boardState);
+    string move;
+    int moveCount = 0;
+    bool cutoff = false;
+    // quiet moves searched here, the history tables hear about all of them after a cutoff
+    int quiets[MAX_MOVES];
+    int quietCount = 0;
+    while(!cutoff && nextMove<Us>(picker, move)) {
+        ++moveCount;
+        if(frontier && moveCount > 1) {
+            if(picker.stage == PICK_BAD_CAPTURES) continue;
+            // a quiet move to a square nobody attacks loses nothing,
+            // pawn and king moves are left alone since they rarely hang anything here
+            if(picker.stage == PICK_KILLERS || picker.stage == PICK_QUIETS) {
+                char mover = boardState[move[0] - '0'][move[1] - '0'].name;
+                if(mover != 'P' && mover != 'K' && squareAttacked<Them>(boardState, move[2] - '0', move[3] - '0') && see(boardState, move) < 0) continue;
+            }
+        }
+        cutoff = searchMove(move);
+        if(!isCapture(boardState, move)) quiets[quietCount++] = moveIndex(boardState[move[0] - '0'][move[1] - '0'], move);
+    }
+
+    // no legal move: mated, or stalemate
+    // nearer mates score higher so the search goes for the quickest one
+    if(moveCount == 0) {
+        int score = 0;
+        if(inCheck<Us>(boardState)) score = team ? -(MATE_SCORE - depth) : MATE_SCORE - depth;
+        return make_pair(score, bestMove);
+    }
+
+    // a quiet move that cut off here is tried early at this ply in sibling subtrees
+    if(cutoff && depth < MAX_PLY && !isCapture(boardState, move) && move != killerMoves[depth][0]) {
+        killerMoves[depth][1] = killerMoves[depth][0];
+        killerMoves[depth][0] = move;
     }
+
+    // and for every thread: the refutation of the opponent's move, and a bonus for it
+    // in the history tables against the quiet moves that were tried before it and failed
+    if(cutoff && !isCapture(boardState, move) && !stopSearch.load(memory_order_relaxed)) {
+        int bonus = min(remaining * remaining, 400);
+        if(picker.counter >= 0) {
+            counterMoves[picker.counter].store(4096 | ((move[0] - '0') * 8 + (move[1] - '0')) << 6 | ((move[2] - '0') * 8 + (move[3] - '0')), memory_order_relaxed);
+        }
+        for(int q = 0; q < quietCount; ++q) {
+            int b = q == quietCount - 1 ? bonus : -bonus;
+            if(picker.counter >= 0) updateHistory(counterHistory[picker.counter][quiets[q]], b);
+            if(picker.followup >= 0) updateHistory(followupHistory[picker.followup][quiets[q]], b);
+        }
+    }
+
+    // scores of an aborted search are not worth keeping
+    if(!stopSearch.load(memory_order_relaxed)) {
+        int bound = bestScore <= alphaStart ? BOUND_UPPER : bestScore >= betaStart ? BOUND_LOWER : BOUND_EXACT;
+        storeTT(key, depth, bestScore, remaining, bound, nodeBest);
+    }
+
+    return make_pair(bestScore, bestMove); // Return the best score found
 }
 
+pair<int, string> minimax(Board& boardState, int depth, int maxDepth, bool team, string bestMove, int alpha, int beta) {
+    if(team) return minimax<WHITE>(boardState, depth, maxDepth, bestMove, alpha, beta);
+    return minimax<BLACK>(boardState, depth, maxDepth, bestMove, alpha, beta);
+}
 
-void playFirstMoves(vector<vector<Piece>>& boardState, vector<string>& moveList) {
-    string currPos, endPos, convertedEndPos;
-    int currI, currJ, endI, endJ;
-    Piece currPiece;
+bool shouldStop() {
+    if(stopSearch.load(memory_order_relaxed)) return true;
 
-    // we want to start as white
-    bool colorOrder = true;
-    for(auto& move : moveList) {
-        currPos = move.substr(0, 2);
-        convertToIJ(currPos, currI, currJ);
-        endPos = move.substr(2, 2);
-        convertToIJ(endPos, endI, endJ);
+    // only look at the clock every checkInterval nodes
+    if(--nodesUntilCheck > 0) return false;
+    nodesUntilCheck = checkInterval;
 
-        convertedEndPos = to_string(endI) + to_string(endJ); 
+    if((timeLimited && high_resolution_clock::now() >= searchDeadline)
+        || (nodeLimit && searchNodes.load(memory_order_relaxed) + nodeCount >= nodeLimit)) {
+        stopSearch.store(true);
+        return true;
+    }
+    return false;
+}
 
-        boardState[currI][currJ].possibleMove = possibleMoves(boardState, currI, currJ);
+// workers exit once the queue is empty
+void releasePool(vector<pthread_t>& threads) {
+    pthread_mutex_lock(&queueLock);
+    shutdownPool = true;
+    pthread_cond_broadcast(&queueReady);
+    pthread_mutex_unlock(&queueLock);
 
+    for(int i=0; i < (int)threads.size(); ++i) {
+        pthread_join(threads[i], nullptr);
+    }
+}
 
-        if(boardState[currI][currJ].name != '-' && boardState[currI][currJ].color == colorOrder) {
-            for(auto& possibleMove : boardState[currI][currJ].possibleMove) {
-                if(possibleMove == convertedEndPos) {
-                    if(boardState[endI][endJ].name == '-') {
-                        swap(boardState[currI][currJ], boardState[endI][endJ]);
-                    }
+void handleStopSignal(int sig) {
+    // a second signal kills the process the usual way
+    stopSignalled = 1;
+    stopSearch.store(true);
+    signal(sig, SIG_DFL);
+}
 
-                    else {
-                        boardState[endI][endJ].name = '-';
-                        boardState[endI][endJ].color = true;
-                        swap(boardState[currI][currJ], boardState[endI][endJ]);
-                    }
+// pthread_cond_wait that also returns after signalPoll ms, for waits that a signal has to end
+void pollWait(pthread_cond_t& ready, pthread_mutex_t& lock) {
+    timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_nsec += signalPoll * 1000000L;
+    until.tv_sec += until.tv_nsec / 1000000000L;
+    until.tv_nsec %= 1000000000L;
+    pthread_cond_timedwait(&ready, &lock, &until);
+}
 
-                    continue;
+void* listenForCommands(void*) {
+    string command;
+    while(cin >> command) {
+        pthread_mutex_lock(&commandLock);
+        if(command == "quit") {
+            quitRequested = true;
+            stopSearch.store(true);
+        }
+        else if(command == "stop") {
+            // a stopped ponder search is a miss, the actual move comes next
+            stopSearch.store(true);
+        }
+        else if(command == "ponderhit" || isMoveString(command)) {
+            if(pondering && !ponderHit && (command == "ponderhit" || command == ponderMove)) {
+                // the ponder search becomes the real one, its clock starts now
+                ponderHit = true;
+                if(moveTime > 0) {
+                    searchDeadline = high_resolution_clock::now() + std::chrono::milliseconds(moveTime);
+                    timeLimited.store(true);
                 }
             }
+            else {
+                if(pondering && !ponderHit) stopSearch.store(true);
+                opponentMoves.push(command);
+            }
         }
-        else throw runtime_error("Incorrect Piece Position Called");
+        pthread_cond_broadcast(&commandReady);
+        pthread_mutex_unlock(&commandLock);
+    }
 
-        colorOrder = !colorOrder;
+    // no more input, nobody will ever answer a ponder search
+    pthread_mutex_lock(&commandLock);
+    quitRequested = true;
+    if(pondering && !ponderHit) stopSearch.store(true);
+    pthread_cond_broadcast(&commandReady);
+    pthread_mutex_unlock(&commandLock);
+    return NULL;
+}
+
+bool isMoveString(string& command) {
+    return (command.size() == 4 || (command.size() == 5 && string("qrbn").find(command[4]) != string::npos))
+        && command[0] >= 'a' && command[0] <= 'h' && command[1] >= '1' && command[1] <= '8'
+        && command[2] >= 'a' && command[2] <= 'h' && command[3] >= '1' && command[3] <= '8';
+}
+
+void initZobrist() {
+    // fixed seed, keys stay the same from run to run
+    mt19937_64 rng(ZOBRIST_SEED);
+    for(int c = 0; c < 2; ++c) {
+        for(int p = 0; p < 6; ++p) {
+            for(int sq = 0; sq < 64; ++sq) {
+                zobristPieces[c][p][sq] = rng();
+            }
+        }
     }
+    zobristBlackToMove = rng();
+    for(auto& k : zobristCastling) k = rng();
+    for(auto& k : zobristEnPassant) k = rng();
 }
 
-void convertToIJ(string& move, int& iVal, int& jVal) {
-    iVal = 7 - (move[1] - 49);
-    jVal = move[0] - 'a';
-    
+int pieceIndex(char name) {
+    switch(name) {
+        case 'P': return 0;
+        case 'N': return 1;
+        case 'B': return 2;
+        case 'R': return 3;
+        case 'Q': return 4;
+        case 'K': return 5;
+    }
+    return -1;
 }
 
-string convertToUCI(int iCurr, int jCurr, int iEnd, int jEnd) {
-    char rowStart = '1' + (7 - iCurr);
-    char colStart = 'a' + jCurr;
+uint64_t hashBoard(Board& boardState, bool team) {
+    uint64_t key = team ? 0 : zobristBlackToMove;
+    for(int i = 0; i < 8; ++i) {
+        for(int j = 0; j < 8; ++j) {
+            if(boardState[i][j].name != '-') {
+                key ^= zobristPieces[boardState[i][j].color][pieceIndex(boardState[i][j].name)][i * 8 + j];
+                if(boardState[i][j].passant) key ^= zobristEnPassant[j];
+            }
+        }
+    }
+    int rights = castlingRights(boardState);
+    for(int r = 0; r < 4; ++r) {
+        if(rights >> r & 1) key ^= zobristCastling[r];
+    }
+    return key;
+}
 
-    char rowEnd = '1' + (7 - iEnd);
-    char colEnd = 'a' + jEnd;
+void resizeTT(size_t megabytes) {
+    // round down to a power of two so the index is a mask
+    size_t entries = megabytes * 1024 * 1024 / sizeof(TTEntry);
+    size_t size = 1;
+    while(size * 2 <= entries) size *= 2;
+
+    // mmap hands out zeroed pages, an all zero entry is empty and nothing is touched yet
+    if(ttMemory) munmap(ttMemory, ttMemoryBytes);
+    ttBytes = size * sizeof(TTEntry);
+
+    // every probe lands on a random page, with 4 KB pages most of them also miss the TLB
+    // reserved huge pages first, then transparent ones on a 2 MB aligned block, then plain pages
+    string pages = "2 MB reserved huge pages";
+    ttMemory = MAP_FAILED;
+    if(ttBytes % HUGE_PAGE == 0) {
+        ttMemoryBytes = ttBytes;
+        ttMemory = mmap(NULL, ttMemoryBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+    void* memory = ttMemory;
+    if(ttMemory == MAP_FAILED) {
+        ttMemoryBytes = ttBytes + HUGE_PAGE;
+        ttMemory = mmap(NULL, ttMemoryBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(ttMemory == MAP_FAILED) throw runtime_error("Cannot allocate the transposition table.");
+        memory = (void*)(((uintptr_t)ttMemory + HUGE_PAGE - 1) & ~(uintptr_t)(HUGE_PAGE - 1));
+        bool huge = ttBytes >= HUGE_PAGE && transparentHugePages() && madvise(memory, ttBytes, MADV_HUGEPAGE) == 0;
+        pages = huge ? "2 MB transparent huge pages" : "4 KB pages";
+    }
+    cerr << "transposition table: " << ttBytes / (1024 * 1024) << " MB in " << pages << endl;
+
+    // every thread probes every page, so no one node should hold them all
+    if(numaMode && numaNodes.size() > 1) {
+        unsigned long mask = 0;
+        for(auto& node : numaNodes) mask |= 1UL << node.id;
+        if(syscall(SYS_mbind, memory, ttBytes, NUMA_INTERLEAVE, &mask, sizeof(mask) * 8, 0) == 0) {
+            cerr << "transposition table interleaved over " << numaNodes.size() << " nodes" << endl;
+        } else {
+            cerr << "cannot interleave the transposition table, pages go where they are first used" << endl;
+        }
+    }
 
-    return string(1, colStart) + string(1, rowStart) + string(1, colEnd) + string(1, rowEnd);
+    transTable = (TTEntry*)memory;
+    ttMask = size - 1;
 }
 
+// madvise succeeds either way, the kernel setting says whether it does anything
+bool transparentHugePages() {
+    ifstream setting("/sys/kernel/mm/transparent_hugepage/enabled");
+    string enabled;
+    getline(setting, enabled);
+    return !enabled.empty() && enabled.find("[never]") == string::npos;
+}
 
-void initialBoard(vector<vector<Piece>>& boardState) {
-    for(int i = 2; i < 6; ++i) {
-        for(int j = 0; j < 8; ++j) {
-            Piece basic;
-            basic.color = true;
-            basic.name = '-';
-            boardState[i][j] = basic;
+void* touchTTRange(void* arg) {
+    pair<size_t, size_t>& range = *(pair<size_t, size_t>*)arg;
+    // one write per 4 KB is enough to fault in the page, or the huge page around it
+    for(size_t e = range.first; e < range.second; e += 4096 / sizeof(TTEntry)) {
+        transTable[e].data.store(0, memory_order_relaxed);
+    }
+    return NULL;
+}
+
+// fault the whole table in now, spread over threads, rather than during the first search
+void touchTT(int threads) {
+    size_t entries = ttMask + 1;
+    vector<pair<size_t, size_t>> ranges(threads);
+    vector<pthread_t> touchers(threads);
+    vector<bool> started(threads);
+    for(int t = 0; t < threads; ++t) {
+        ranges[t] = {entries * t / threads, entries * (t + 1) / threads};
+        started[t] = ::pthread_create(&touchers[t], nullptr, touchTTRange, &ranges[t]) == 0;
+        if(!started[t]) touchTTRange(&ranges[t]);
+    }
+    for(int t = 0; t < threads; ++t) {
+        if(started[t]) pthread_join(touchers[t], nullptr);
+    }
+}
+
+// a snapshot from another version, seed or table size is left alone and the search starts cold
+bool loadTT(string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0) {
+        cerr << "no hash file " << path << " yet, starting cold" << endl;
+        return false;
+    }
+    struct stat info;
+    size_t fileBytes = fstat(fd, &info) == 0 ? info.st_size : 0;
+    void* mapped = fileBytes >= HASH_HEADER_BYTES ? mmap(NULL, fileBytes, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if(mapped == MAP_FAILED) {
+        cerr << "cannot read hash file " << path << ", starting cold" << endl;
+        return false;
+    }
+
+    HashFileHeader& header = *(HashFileHeader*)mapped;
+    string problem;
+    if(memcmp(header.magic, "CMPHASH1", 8) != 0) problem = "not a hash file";
+    else if(header.version != HASH_FILE_VERSION || header.entrySize != sizeof(TTEntry)) problem = "written by another version";
+    else if(header.seed != ZOBRIST_SEED) problem = "hashed with other keys";
+    else if(header.entries != ttMask + 1) {
+        problem = "made for a " + to_string(header.entries * sizeof(TTEntry) / (1024 * 1024)) + " MB table";
+    }
+    else if(fileBytes < HASH_HEADER_BYTES + ttBytes) problem = "truncated";
+
+    if(problem.empty()) {
+        // copied rather than mapped in, so the table keeps its huge pages
+        memcpy((void*)transTable, (char*)mapped + HASH_HEADER_BYTES, ttBytes);
+        ttGeneration = header.generation;
+        cerr << "hash file " << path << " loaded" << endl;
+    } else {
+        cerr << "hash file " << path << " " << problem << ", starting cold" << endl;
+    }
+    munmap(mapped, fileBytes);
+    return problem.empty();
+}
+
+// written next to the old file and renamed over it, a crash mid-write keeps the last snapshot
+void saveTT(string& path) {
+    string temporary = path + ".tmp";
+    int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) {
+        cerr << "cannot write hash file " << path << endl;
+        return;
+    }
+
+    char header[HASH_HEADER_BYTES] = {0};
+    HashFileHeader& fields = *(HashFileHeader*)header;
+    memcpy(fields.magic, "CMPHASH1", 8);
+    fields.version = HASH_FILE_VERSION;
+    fields.entrySize = sizeof(TTEntry);
+    fields.entries = ttMask + 1;
+    fields.seed = ZOBRIST_SEED;
+    fields.generation = ttGeneration;
+
+    bool ok = write(fd, header, HASH_HEADER_BYTES) == (ssize_t)HASH_HEADER_BYTES;
+    for(size_t done = 0; ok && done < ttBytes; ) {
+        ssize_t n = write(fd, (char*)transTable + done, min(ttBytes - done, (size_t)1 << 30));
+        ok = n > 0;
+        done += max(n, (ssize_t)0);
+    }
+    ok = close(fd) == 0 && ok;
+    if(!ok || rename(temporary.c_str(), path.c_str()) != 0) {
+        unlink(temporary.c_str());
+        cerr << "cannot write hash file " << path << endl;
+        return;
+    }
+    cerr << "hash file " << path << " saved" << endl;
+}
+
+// "0-3,8-11" style lists, as sysfs writes them
+vector<int> parseCpuList(string& list) {
+    vector<int> cpus;
+    stringstream ranges(list);
+    string range;
+    while(getline(ranges, range, ',')) {
+        if(range.empty()) continue;
+        size_t dash = range.find('-');
+        int first = stoi(range.substr(0, dash));
+        int last = dash == string::npos ? first : stoi(range.substr(dash + 1));
+        for(int cpu = first; cpu <= last; ++cpu) cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+void initNuma() {
+    ifstream online("/sys/devices/system/node/online");
+    string nodeList;
+    if(online >> nodeList) {
+        for(int id : parseCpuList(nodeList)) {
+            ifstream cpus("/sys/devices/system/node/node" + to_string(id) + "/cpulist");
+            NumaNode node = {id, "", {}};
+            if(cpus >> node.cpuList) node.cpus = parseCpuList(node.cpuList);
+            // memory only nodes have nothing to run a thread on
+            if(!node.cpus.empty()) numaNodes.push_back(node);
         }
     }
 
-    for(int j = 0; j < 8; ++j) {
-        Piece pawnWhite;
-        pawnWhite.color = true;
-        pawnWhite.name = 'P';
+    // no numa in sysfs, the whole machine is one node
+    if(numaNodes.empty()) {
+        int count = sysconf(_SC_NPROCESSORS_ONLN);
+        NumaNode node = {0, "0-" + to_string(count - 1), {}};
+        for(int cpu = 0; cpu < count; ++cpu) node.cpus.push_back(cpu);
+        numaNodes.push_back(node);
+    }
 
-        Piece pawnBlack;
-        pawnBlack.color = false;
-        pawnBlack.name = 'P';
-        
-        boardState[6][j] = pawnWhite;
-        boardState[1][j] = pawnBlack;
+    cerr << "numa: " << numaNodes.size() << " nodes" << endl;
+    for(auto& node : numaNodes) {
+        cerr << "  node " << node.id << ": cpus " << node.cpuList << endl;
     }
+}
 
-    Piece knightWhite;
-    knightWhite.color = true;
-    knightWhite.name = 'N';
+// threads go round robin over the nodes, then over the cpus within each node
+// pinned before it starts, so its per-thread scratch is first touched on its own node
+void numaAffinity(pthread_attr_t& attr, int index) {
+    NumaNode& node = numaNodes[index % numaNodes.size()];
+    int cpu = node.cpus[index / numaNodes.size() % node.cpus.size()];
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if(pthread_attr_setaffinity_np(&attr, sizeof(set), &set) != 0) {
+        cerr << "cannot pin thread " << index << endl;
+        return;
+    }
+    cerr << "thread " << index << " on cpu " << cpu << ", node " << node.id << endl;
+}
+
+// data layout: score 32 bits | from 6 | to 6 | promotion 3 | depth 7 | bound 2 | generation 8
+// from == to means no move, promotion is 0 or 1 + the piece's place in "NBRQ"
+// depth fits in 7 bits, no line is MAX_PLY deep
+// mate scores count from the root of the search, in the table they count from the entry's own
+// node instead (ply is how deep that node is) so a hit at another ply or in a later search still
+// gets the right distance
+const string TT_PROMOTIONS = "NBRQ";
+
+bool probeTT(uint64_t key, int ply, int& score, int& depth, int& bound, string& move) {
+    TTEntry& entry = transTable[key & ttMask];
+    uint64_t data = entry.data.load(memory_order_relaxed);
+    if((entry.key.load(memory_order_relaxed) ^ data) != key || data == 0) return false;
+
+    score = (int32_t)(uint32_t)data;
+    if(score > MATE_SCORE - MAX_PLY) score -= ply;
+    else if(score < -(MATE_SCORE - MAX_PLY)) score += ply;
+    int from = (data >> 32) & 63;
+    int to = (data >> 38) & 63;
+    if(from != to) {
+        move = to_string(from / 8) + to_string(from % 8) + to_string(to / 8) + to_string(to % 8);
+        int promotion = (data >> 44) & 7;
+        if(promotion) move += TT_PROMOTIONS[promotion - 1];
+    }
+    depth = (data >> 47) & 127;
+    bound = (data >> 54) & 3;
+    return true;
+}
+
+void storeTT(uint64_t key, int ply, int score, int depth, int bound, string move) {
+    TTEntry& entry = transTable[key & ttMask];
+    if(score > MATE_SCORE - MAX_PLY) score += ply;
+    else if(score < -(MATE_SCORE - MAX_PLY)) score -= ply;
+    uint64_t old = entry.data.load(memory_order_relaxed);
+    bool sameKey = (entry.key.load(memory_order_relaxed) ^ old) == key;
+
+    // keep deeper results of the current search, anything older may go
+    if(old != 0 && ((old >> 56) & 255) == ttGeneration && (int)((old >> 47) & 127) > depth) return;
+
+    // keep the old move if this result did not find one
+    uint64_t moveBits = 0;
+    if(move.size() >= 4) {
+        int from = (move[0] - '0') * 8 + (move[1] - '0');
+        int to = (move[2] - '0') * 8 + (move[3] - '0');
+        int promotion = move.size() == 5 ? TT_PROMOTIONS.find(move[4]) + 1 : 0;
+        moveBits = (uint64_t)from << 32 | (uint64_t)to << 38 | (uint64_t)promotion << 44;
+    }
+    else if(sameKey) {
+        moveBits = old & (0x7FFFULL << 32);
+    }
+
+    uint64_t data = (uint64_t)(uint32_t)score | moveBits | (uint64_t)(depth & 127) << 47
+        | (uint64_t)bound << 54 | (uint64_t)ttGeneration << 56;
+    entry.key.store(key ^ data, memory_order_relaxed);
+    entry.data.store(data, memory_order_relaxed);
+}
+
+// the Random64 table from the polyglot format description, in bookKeys order
+const uint64_t POLYGLOT_RANDOM64[781] = {
+    0x9D39247E33776D41, 0x2AF7398005AAA5C7, 0x44DB015024623547, 0x9C15F73E62A76AE2,
+    0x75834465489C0C89, 0x3290AC3A203001BF, 0x0FBBAD1F61042279, 0xE83A908FF2FB60CA,
+    0x0D7E765D58755C10, 0x1A083822CEAFE02D, 0x9605D5F0E25EC3B0, 0xD021FF5CD13A2ED5,
+    0x40BDF15D4A672E32, 0x011355146FD56395, 0x5DB4832046F3D9E5, 0x239F8B2D7FF719CC,
+    0x05D1A1AE85B49AA1, 0x679F848F6E8FC971, 0x7449BBFF801FED0B, 0x7D11CDB1C3B7ADF0,
+    0x82C7709E781EB7CC, 0xF3218F1C9510786C, 0x331478F3AF51BBE6, 0x4BB38DE5E7219443,
+    0xAA649C6EBCFD50FC, 0x8DBD98A352AFD40B, 0x87D2074B81D79217, 0x19F3C751D3E92AE1,
+    0xB4AB30F062B19ABF, 0x7B0500AC42047AC4, 0xC9452CA81A09D85D, 0x24AA6C514DA27500,
+    0x4C9F34427501B447, 0x14A68FD73C910841, 0xA71B9B83461CBD93, 0x03488B95B0F1850F,
+    0x637B2B34FF93C040, 0x09D1BC9A3DD90A94, 0x3575668334A1DD3B, 0x735E2B97A4C45A23,
+    0x18727070F1BD400B, 0x1FCBACD259BF02E7, 0xD310A7C2CE9B6555, 0xBF983FE0FE5D8244,
+    0x9F74D14F7454A824, 0x51EBDC4AB9BA3035, 0x5C82C505DB9AB0FA, 0xFCF7FE8A3430B241,
+    0x3253A729B9BA3DDE, 0x8C74C368081B3075, 0xB9BC6C87167C33E7, 0x7EF48F2B83024E20,
+    0x11D505D4C351BD7F, 0x6568FCA92C76A243, 0x4DE0B0F40F32A7B8, 0x96D693460CC37E5D,
+    0x42E240CB63689F2F, 0x6D2BDCDAE2919661, 0x42880B0236E4D951, 0x5F0F4A5898171BB6,
+    0x39F890F579F92F88, 0x93C5B5F47356388B, 0x63DC359D8D231B78, 0xEC16CA8AEA98AD76,
+    0x5355F900C2A82DC7, 0x07FB9F855A997142, 0x5093417AA8A7ED5E, 0x7BCBC38DA25A7F3C,
+    0x19FC8A768CF4B6D4, 0x637A7780DECFC0D9, 0x8249A47AEE0E41F7, 0x79AD695501E7D1E8,
+    0x14ACBAF4777D5776, 0xF145B6BECCDEA195, 0xDABF2AC8201752FC, 0x24C3C94DF9C8D3F6,
+    0xBB6E2924F03912EA, 0x0CE26C0B95C980D9, 0xA49CD132BFBF7CC4, 0xE99D662AF4243939,
+    0x27E6AD7891165C3F, 0x8535F040B9744FF1, 0x54B3F4FA5F40D873, 0x72B12C32127FED2B,
+    0xEE954D3C7B411F47, 0x9A85AC909A24EAA1, 0x70AC4CD9F04F21F5, 0xF9B89D3E99A075C2,
+    0x87B3E2B2B5C907B1, 0xA366E5B8C54F48B8, 0xAE4A9346CC3F7CF2, 0x1920C04D47267BBD,
+    0x87BF02C6B49E2AE9, 0x092237AC237F3859, 0xFF07F64EF8ED14D0, 0x8DE8DCA9F03CC54E,
+    0x9C1633264DB49C89, 0xB3F22C3D0B0B38ED, 0x390E5FB44D01144B, 0x5BFEA5B4712768E9,
+    0x1E1032911FA78984, 0x9A74ACB964E78CB3, 0x4F80F7A035DAFB04, 0x6304D09A0B3738C4,
+    0x2171E64683023A08, 0x5B9B63EB9CEFF80C, 0x506AACF489889342, 0x1881AFC9A3A701D6,
+    0x6503080440750644, 0xDFD395339CDBF4A7, 0xEF927DBCF00C20F2, 0x7B32F7D1E03680EC,
+    0xB9FD7620E7316243, 0x05A7E8A57DB91B77, 0xB5889C6E15630A75, 0x4A750A09CE9573F7,
+    0xCF464CEC899A2F8A, 0xF538639CE705B824, 0x3C79A0FF5580EF7F, 0xEDE6C87F8477609D,
+    0x799E81F05BC93F31, 0x86536B8CF3428A8C, 0x97D7374C60087B73, 0xA246637CFF328532,
+    0x043FCAE60CC0EBA0, 0x920E449535DD359E, 0x70EB093B15B290CC, 0x73A1921916591CBD,
+    0x56436C9FE1A1AA8D, 0xEFAC4B70633B8F81, 0xBB215798D45DF7AF, 0x45F20042F24F1768,
+    0x930F80F4E8EB7462, 0xFF6712FFCFD75EA1, 0xAE623FD67468AA70, 0xDD2C5BC84BC8D8FC,
+    0x7EED120D54CF2DD9, 0x22FE545401165F1C, 0xC91800E98FB99929, 0x808BD68E6AC10365,
+    0xDEC468145B7605F6, 0x1BEDE3A3AEF53302, 0x43539603D6C55602, 0xAA969B5C691CCB7A,
+    0xA87832D392EFEE56, 0x65942C7B3C7E11AE, 0xDED2D633CAD004F6, 0x21F08570F420E565,
+    0xB415938D7DA94E3C, 0x91B859E59ECB6350, 0x10CFF333E0ED804A, 0x28AED140BE0BB7DD,
+    0xC5CC1D89724FA456, 0x5648F680F11A2741, 0x2D255069F0B7DAB3, 0x9BC5A38EF729ABD4,
+    0xEF2F054308F6A2BC, 0xAF2042F5CC5C2858, 0x480412BAB7F5BE2A, 0xAEF3AF4A563DFE43,
+    0x19AFE59AE451497F, 0x52593803DFF1E840, 0xF4F076E65F2CE6F0, 0x11379625747D5AF3,
+    0xBCE5D2248682C115, 0x9DA4243DE836994F, 0x066F70B33FE09017, 0x4DC4DE189B671A1C,
+    0x51039AB7712457C3, 0xC07A3F80C31FB4B4, 0xB46EE9C5E64A6E7C, 0xB3819A42ABE61C87,
+    0x21A007933A522A20, 0x2DF16F761598AA4F, 0x763C4A1371B368FD, 0xF793C46702E086A0,
+    0xD7288E012AEB8D31, 0xDE336A2A4BC1C44B, 0x0BF692B38D079F23, 0x2C604A7A177326B3,
+    0x4850E73E03EB6064, 0xCFC447F1E53C8E1B, 0xB05CA3F564268D99, 0x9AE182C8BC9474E8,
+    0xA4FC4BD4FC5558CA, 0xE755178D58FC4E76, 0x69B97DB1A4C03DFE, 0xF9B5B7C4ACC67C96,
+    0xFC6A82D64B8655FB, 0x9C684CB6C4D24417, 0x8EC97D2917456ED0, 0x6703DF9D2924E97E,
+    0xC547F57E42A7444E, 0x78E37644E7CAD29E, 0xFE9A44E9362F05FA, 0x08BD35CC38336615,
+    0x9315E5EB3A129ACE, 0x94061B871E04DF75, 0xDF1D9F9D784BA010, 0x3BBA57B68871B59D,
+    0xD2B7ADEEDED1F73F, 0xF7A255D83BC373F8, 0xD7F4F2448C0CEB81, 0xD95BE88CD210FFA7,
+    0x336F52F8FF4728E7, 0xA74049DAC312AC71, 0xA2F61BB6E437FDB5, 0x4F2A5CB07F6A35B3,
+    0x87D380BDA5BF7859, 0x16B9F7E06C453A21, 0x7BA2484C8A0FD54E, 0xF3A678CAD9A2E38C,
+    0x39B0BF7DDE437BA2, 0xFCAF55C1BF8A4424, 0x18FCF680573FA594, 0x4C0563B89F495AC3,
+    0x40E087931A00930D, 0x8CFFA9412EB642C1, 0x68CA39053261169F, 0x7A1EE967D27579E2,
+    0x9D1D60E5076F5B6F, 0x3810E399B6F65BA2, 0x32095B6D4AB5F9B1, 0x35CAB62109DD038A,
+    0xA90B24499FCFAFB1, 0x77A225A07CC2C6BD, 0x513E5E634C70E331, 0x4361C0CA3F692F12,
+    0xD941ACA44B20A45B, 0x528F7C8602C5807B, 0x52AB92BEB9613989, 0x9D1DFA2EFC557F73,
+    0x722FF175F572C348, 0x1D1260A51107FE97, 0x7A249A57EC0C9BA2, 0x04208FE9E8F7F2D6,
+    0x5A110C6058B920A0, 0x0CD9A497658A5698, 0x56FD23C8F9715A4C, 0x284C847B9D887AAE,
+    0x04FEABFBBDB619CB, 0x742E1E651C60BA83, 0x9A9632E65904AD3C, 0x881B82A13B51B9E2,
+    0x506E6744CD974924, 0xB0183DB56FFC6A79, 0x0ED9B915C66ED37E, 0x5E11E86D5873D484,
+    0xF678647E3519AC6E, 0x1B85D488D0F20CC5, 0xDAB9FE6525D89021, 0x0D151D86ADB73615,
+    0xA865A54EDCC0F019, 0x93C42566AEF98FFB, 0x99E7AFEABE000731, 0x48CBFF086DDF285A,
+    0x7F9B6AF1EBF78BAF, 0x58627E1A149BBA21, 0x2CD16E2ABD791E33, 0xD363EFF5F0977996,
+    0x0CE2A38C344A6EED, 0x1A804AADB9CFA741, 0x907F30421D78C5DE, 0x501F65EDB3034D07,
+    0x37624AE5A48FA6E9, 0x957BAF61700CFF4E, 0x3A6C27934E31188A, 0xD49503536ABCA345,
+    0x088E049589C432E0, 0xF943AEE7FEBF21B8, 0x6C3B8E3E336139D3, 0x364F6FFA464EE52E,
+    0xD60F6DCEDC314222, 0x56963B0DCA418FC0, 0x16F50EDF91E513AF, 0xEF1955914B609F93,
+    0x565601C0364E3228, 0xECB53939887E8175, 0xBAC7A9A18531294B, 0xB344C470397BBA52,
+    0x65D34954DAF3CEBD, 0xB4B81B3FA97511E2, 0xB422061193D6F6A7, 0x071582401C38434D,
+    0x7A13F18BBEDC4FF5, 0xBC4097B116C524D2, 0x59B97885E2F2EA28, 0x99170A5DC3115544,
+    0x6F423357E7C6A9F9, 0x325928EE6E6F8794, 0xD0E4366228B03343, 0x565C31F7DE89EA27,
+    0x30F5611484119414, 0xD873DB391292ED4F, 0x7BD94E1D8E17DEBC, 0xC7D9F16864A76E94,
+    0x947AE053EE56E63C, 0xC8C93882F9475F5F, 0x3A9BF55BA91F81CA, 0xD9A11FBB3D9808E4,
+    0x0FD22063EDC29FCA, 0xB3F256D8ACA0B0B9, 0xB03031A8B4516E84, 0x35DD37D5871448AF,
+    0xE9F6082B05542E4E, 0xEBFAFA33D7254B59, 0x9255ABB50D532280, 0xB9AB4CE57F2D34F3,
+    0x693501D628297551, 0xC62C58F97DD949BF, 0xCD454F8F19C5126A, 0xBBE83F4ECC2BDECB,
+    0xDC842B7E2819E230, 0xBA89142E007503B8, 0xA3BC941D0A5061CB, 0xE9F6760E32CD8021,
+    0x09C7E552BC76492F, 0x852F54934DA55CC9, 0x8107FCCF064FCF56, 0x098954D51FFF6580,
+    0x23B70EDB1955C4BF, 0xC330DE426430F69D, 0x4715ED43E8A45C0A, 0xA8D7E4DAB780A08D,
+    0x0572B974F03CE0BB, 0xB57D2E985E1419C7, 0xE8D9ECBE2CF3D73F, 0x2FE4B17170E59750,
+    0x11317BA87905E790, 0x7FBF21EC8A1F45EC, 0x1725CABFCB045B00, 0x964E915CD5E2B207,
+    0x3E2B8BCBF016D66D, 0xBE7444E39328A0AC, 0xF85B2B4FBCDE44B7, 0x49353FEA39BA63B1,
+    0x1DD01AAFCD53486A, 0x1FCA8A92FD719F85, 0xFC7C95D827357AFA, 0x18A6A990C8B35EBD,
+    0xCCCB7005C6B9C28D, 0x3BDBB92C43B17F26, 0xAA70B5B4F89695A2, 0xE94C39A54A98307F,
+    0xB7A0B174CFF6F36E, 0xD4DBA84729AF48AD, 0x2E18BC1AD9704A68, 0x2DE0966DAF2F8B1C,
+    0xB9C11D5B1E43A07E, 0x64972D68DEE33360, 0x94628D38D0C20584, 0xDBC0D2B6AB90A559,
+    0xD2733C4335C6A72F, 0x7E75D99D94A70F4D, 0x6CED1983376FA72B, 0x97FCAACBF030BC24,
+    0x7B77497B32503B12, 0x8547EDDFB81CCB94, 0x79999CDFF70902CB, 0xCFFE1939438E9B24,
+    0x829626E3892D95D7, 0x92FAE24291F2B3F1, 0x63E22C147B9C3403, 0xC678B6D860284A1C,
+    0x5873888850659AE7, 0x0981DCD296A8736D, 0x9F65789A6509A440, 0x9FF38FED72E9052F,
+    0xE479EE5B9930578C, 0xE7F28ECD2D49EECD, 0x56C074A581EA17FE, 0x5544F7D774B14AEF,
+    0x7B3F0195FC6F290F, 0x12153635B2C0CF57, 0x7F5126DBBA5E0CA7, 0x7A76956C3EAFB413,
+    0x3D5774A11D31AB39, 0x8A1B083821F40CB4, 0x7B4A38E32537DF62, 0x950113646D1D6E03,
+    0x4DA8979A0041E8A9, 0x3BC36E078F7515D7, 0x5D0A12F27AD310D1, 0x7F9D1A2E1EBE1327,
+    0xDA3A361B1C5157B1, 0xDCDD7D20903D0C25, 0x36833336D068F707, 0xCE68341F79893389,
+    0xAB9090168DD05F34, 0x43954B3252DC25E5, 0xB438C2B67F98E5E9, 0x10DCD78E3851A492,
+    0xDBC27AB5447822BF, 0x9B3CDB65F82CA382, 0xB67B7896167B4C84, 0xBFCED1B0048EAC50,
+    0xA9119B60369FFEBD, 0x1FFF7AC80904BF45, 0xAC12FB171817EEE7, 0xAF08DA9177DDA93D,
+    0x1B0CAB936E65C744, 0xB559EB1D04E5E932, 0xC37B45B3F8D6F2BA, 0xC3A9DC228CAAC9E9,
+    0xF3B8B6675A6507FF, 0x9FC477DE4ED681DA, 0x67378D8ECCEF96CB, 0x6DD856D94D259236,
+    0xA319CE15B0B4DB31, 0x073973751F12DD5E, 0x8A8E849EB32781A5, 0xE1925C71285279F5,
+    0x74C04BF1790C0EFE, 0x4DDA48153C94938A, 0x9D266D6A1CC0542C, 0x7440FB816508C4FE,
+    0x13328503DF48229F, 0xD6BF7BAEE43CAC40, 0x4838D65F6EF6748F, 0x1E152328F3318DEA,
+    0x8F8419A348F296BF, 0x72C8834A5957B511, 0xD7A023A73260B45C, 0x94EBC8ABCFB56DAE,
+    0x9FC10D0F989993E0, 0xDE68A2355B93CAE6, 0xA44CFE79AE538BBE, 0x9D1D84FCCE371425,
+    0x51D2B1AB2DDFB636, 0x2FD7E4B9E72CD38C, 0x65CA5B96B7552210, 0xDD69A0D8AB3B546D,
+    0x604D51B25FBF70E2, 0x73AA8A564FB7AC9E, 0x1A8C1E992B941148, 0xAAC40A2703D9BEA0,
+    0x764DBEAE7FA4F3A6, 0x1E99B96E70A9BE8B, 0x2C5E9DEB57EF4743, 0x3A938FEE32D29981,
+    0x26E6DB8FFDF5ADFE, 0x469356C504EC9F9D, 0xC8763C5B08D1908C, 0x3F6C6AF859D80055,
+    0x7F7CC39420A3A545, 0x9BFB227EBDF4C5CE, 0x89039D79D6FC5C5C, 0x8FE88B57305E2AB6,
+    0xA09E8C8C35AB96DE, 0xFA7E393983325753, 0xD6B6D0ECC617C699, 0xDFEA21EA9E7557E3,
+    0xB67C1FA481680AF8, 0xCA1E3785A9E724E5, 0x1CFC8BED0D681639, 0xD18D8549D140CAEA,
+    0x4ED0FE7E9DC91335, 0xE4DBF0634473F5D2, 0x1761F93A44D5AEFE, 0x53898E4C3910DA55,
+    0x734DE8181F6EC39A, 0x2680B122BAA28D97, 0x298AF231C85BAFAB, 0x7983EED3740847D5,
+    0x66C1A2A1A60CD889, 0x9E17E49642A3E4C1, 0xEDB454E7BADC0805, 0x50B704CAB602C329,
+    0x4CC317FB9CDDD023, 0x66B4835D9EAFEA22, 0x219B97E26FFC81BD, 0x261E4E4C0A333A9D,
+    0x1FE2CCA76517DB90, 0xD7504DFA8816EDBB, 0xB9571FA04DC089C8, 0x1DDC0325259B27DE,
+    0xCF3F4688801EB9AA, 0xF4F5D05C10CAB243, 0x38B6525C21A42B0E, 0x36F60E2BA4FA6800,
+    0xEB3593803173E0CE, 0x9C4CD6257C5A3603, 0xAF0C317D32ADAA8A, 0x258E5A80C7204C4B,
+    0x8B889D624D44885D, 0xF4D14597E660F855, 0xD4347F66EC8941C3, 0xE699ED85B0DFB40D,
+    0x2472F6207C2D0484, 0xC2A1E7B5B459AEB5, 0xAB4F6451CC1D45EC, 0x63767572AE3D6174,
+    0xA59E0BD101731A28, 0x116D0016CB948F09, 0x2CF9C8CA052F6E9F, 0x0B090A7560A968E3,
+    0xABEEDDB2DDE06FF1, 0x58EFC10B06A2068D, 0xC6E57A78FBD986E0, 0x2EAB8CA63CE802D7,
+    0x14A195640116F336, 0x7C0828DD624EC390, 0xD74BBE77E6116AC7, 0x804456AF10F5FB53,
+    0xEBE9EA2ADF4321C7, 0x03219A39EE587A30, 0x49787FEF17AF9924, 0xA1E9300CD8520548,
+    0x5B45E522E4B1B4EF, 0xB49C3B3995091A36, 0xD4490AD526F14431, 0x12A8F216AF9418C2,
+    0x001F837CC7350524, 0x1877B51E57A764D5, 0xA2853B80F17F58EE, 0x993E1DE72D36D310,
+    0xB3598080CE64A656, 0x252F59CF0D9F04BB, 0xD23C8E176D113600, 0x1BDA0492E7E4586E,
+    0x21E0BD5026C619BF, 0x3B097ADAF088F94E, 0x8D14DEDB30BE846E, 0xF95CFFA23AF5F6F4,
+    0x3871700761B3F743, 0xCA672B91E9E4FA16, 0x64C8E531BFF53B55, 0x241260ED4AD1E87D,
+    0x106C09B972D2E822, 0x7FBA195410E5CA30, 0x7884D9BC6CB569D8, 0x0647DFEDCD894A29,
+    0x63573FF03E224774, 0x4FC8E9560F91B123, 0x1DB956E450275779, 0xB8D91274B9E9D4FB,
+    0xA2EBEE47E2FBFCE1, 0xD9F1F30CCD97FB09, 0xEFED53D75FD64E6B, 0x2E6D02C36017F67F,
+    0xA9AA4D20DB084E9B, 0xB64BE8D8B25396C1, 0x70CB6AF7C2D5BCF0, 0x98F076A4F7A2322E,
+    0xBF84470805E69B5F, 0x94C3251F06F90CF3, 0x3E003E616A6591E9, 0xB925A6CD0421AFF3,
+    0x61BDD1307C66E300, 0xBF8D5108E27E0D48, 0x240AB57A8B888B20, 0xFC87614BAF287E07,
+    0xEF02CDD06FFDB432, 0xA1082C0466DF6C0A, 0x8215E577001332C8, 0xD39BB9C3A48DB6CF,
+    0x2738259634305C14, 0x61CF4F94C97DF93D, 0x1B6BACA2AE4E125B, 0x758F450C88572E0B,
+    0x959F587D507A8359, 0xB063E962E045F54D, 0x60E8ED72C0DFF5D1, 0x7B64978555326F9F,
+    0xFD080D236DA814BA, 0x8C90FD9B083F4558, 0x106F72FE81E2C590, 0x7976033A39F7D952,
+    0xA4EC0132764CA04B, 0x733EA705FAE4FA77, 0xB4D8F77BC3E56167, 0x9E21F4F903B33FD9,
+    0x9D765E419FB69F6D, 0xD30C088BA61EA5EF, 0x5D94337FBFAF7F5B, 0x1A4E4822EB4D7A59,
+    0x6FFE73E81B637FB3, 0xDDF957BC36D8B9CA, 0x64D0E29EEA8838B3, 0x08DD9BDFD96B9F63,
+    0x087E79E5A57D1D13, 0xE328E230E3E2B3FB, 0x1C2559E30F0946BE, 0x720BF5F26F4D2EAA,
+    0xB0774D261CC609DB, 0x443F64EC5A371195, 0x4112CF68649A260E, 0xD813F2FAB7F5C5CA,
+    0x660D3257380841EE, 0x59AC2C7873F910A3, 0xE846963877671A17, 0x93B633ABFA3469F8,
+    0xC0C0F5A60EF4CDCF, 0xCAF21ECD4377B28C, 0x57277707199B8175, 0x506C11B9D90E8B1D,
+    0xD83CC2687A19255F, 0x4A29C6465A314CD1, 0xED2DF21216235097, 0xB5635C95FF7296E2,
+    0x22AF003AB672E811, 0x52E762596BF68235, 0x9AEBA33AC6ECC6B0, 0x944F6DE09134DFB6,
+    0x6C47BEC883A7DE39, 0x6AD047C430A12104, 0xA5B1CFDBA0AB4067, 0x7C45D833AFF07862,
+    0x5092EF950A16DA0B, 0x9338E69C052B8E7B, 0x455A4B4CFE30E3F5, 0x6B02E63195AD0CF8,
+    0x6B17B224BAD6BF27, 0xD1E0CCD25BB9C169, 0xDE0C89A556B9AE70, 0x50065E535A213CF6,
+    0x9C1169FA2777B874, 0x78EDEFD694AF1EED, 0x6DC93D9526A50E68, 0xEE97F453F06791ED,
+    0x32AB0EDB696703D3, 0x3A6853C7E70757A7, 0x31865CED6120F37D, 0x67FEF95D92607890,
+    0x1F2B1D1F15F6DC9C, 0xB69E38A8965C6B65, 0xAA9119FF184CCCF4, 0xF43C732873F24C13,
+    0xFB4A3D794A9A80D2, 0x3550C2321FD6109C, 0x371F77E76BB8417E, 0x6BFA9AAE5EC05779,
+    0xCD04F3FF001A4778, 0xE3273522064480CA, 0x9F91508BFFCFC14A, 0x049A7F41061A9E60,
+    0xFCB6BE43A9F2FE9B, 0x08DE8A1C7797DA9B, 0x8F9887E6078735A1, 0xB5B4071DBFC73A66,
+    0x230E343DFBA08D33, 0x43ED7F5A0FAE657D, 0x3A88A0FBBCB05C63, 0x21874B8B4D2DBC4F,
+    0x1BDEA12E35F6A8C9, 0x53C065C6C8E63528, 0xE34A1D250E7A8D6B, 0xD6B04D3B7651DD7E,
+    0x5E90277E7CB39E2D, 0x2C046F22062DC67D, 0xB10BB459132D0A26, 0x3FA9DDFB67E2F199,
+    0x0E09B88E1914F7AF, 0x10E8B35AF3EEAB37, 0x9EEDECA8E272B933, 0xD4C718BC4AE8AE5F,
+    0x81536D601170FC20, 0x91B534F885818A06, 0xEC8177F83F900978, 0x190E714FADA5156E,
+    0xB592BF39B0364963, 0x89C350C893AE7DC1, 0xAC042E70F8B383F2, 0xB49B52E587A1EE60,
+    0xFB152FE3FF26DA89, 0x3E666E6F69AE2C15, 0x3B544EBE544C19F9, 0xE805A1E290CF2456,
+    0x24B33C9D7ED25117, 0xE74733427B72F0C1, 0x0A804D18B7097475, 0x57E3306D881EDB4F,
+    0x4AE7D6A36EB5DBCB, 0x2D8D5432157064C8, 0xD1E649DE1E7F268B, 0x8A328A1CEDFE552C,
+    0x07A3AEC79624C7DA, 0x84547DDC3E203C94, 0x990A98FD5071D263, 0x1A4FF12616EEFC89,
+    0xF6F7FD1431714200, 0x30C05B1BA332F41C, 0x8D2636B81555A786, 0x46C9FEB55D120902,
+    0xCCEC0A73B49C9921, 0x4E9D2827355FC492, 0x19EBB029435DCB0F, 0x4659D2B743848A2C,
+    0x963EF2C96B33BE31, 0x74F85198B05A2E7D, 0x5A0F544DD2B1FB18, 0x03727073C2E134B1,
+    0xC7F6AA2DE59AEA61, 0x352787BAA0D7C22F, 0x9853EAB63B5E0B35, 0xABBDCDD7ED5C0860,
+    0xCF05DAF5AC8D77B0, 0x49CAD48CEBF4A71E, 0x7A4C10EC2158C4A6, 0xD9E92AA246BF719E,
+    0x13AE978D09FE5557, 0x730499AF921549FF, 0x4E4B705B92903BA4, 0xFF577222C14F0A3A,
+    0x55B6344CF97AAFAE, 0xB862225B055B6960, 0xCAC09AFBDDD2CDB4, 0xDAF8E9829FE96B5F,
+    0xB5FDFC5D3132C498, 0x310CB380DB6F7503, 0xE87FBB46217A360E, 0x2102AE466EBB1148,
+    0xF8549E1A3AA5E00D, 0x07A69AFDCC42261A, 0xC4C118BFE78FEAAE, 0xF9F4892ED96BD438,
+    0x1AF3DBE25D8F45DA, 0xF5B4B0B0D2DEEEB4, 0x962ACEEFA82E1C84, 0x046E3ECAAF453CE9,
+    0xF05D129681949A4C, 0x964781CE734B3C84, 0x9C2ED44081CE5FBD, 0x522E23F3925E319E,
+    0x177E00F9FC32F791, 0x2BC60A63A6F3B3F2, 0x222BBFAE61725606, 0x486289DDCC3D6780,
+    0x7DC7785B8EFDFC80, 0x8AF38731C02BA980, 0x1FAB64EA29A2DDF7, 0xE4D9429322CD065A,
+    0x9DA058C67844F20C, 0x24C0E332B70019B0, 0x233003B5A6CFE6AD, 0xD586BD01C5C217F6,
+    0x5E5637885F29BC2B, 0x7EBA726D8C94094B, 0x0A56A5F0BFE39272, 0xD79476A84EE20D06,
+    0x9E4C1269BAA4BF37, 0x17EFEE45B0DEE640, 0x1D95B0A5FCF90BC6, 0x93CBE0B699C2585D,
+    0x65FA4F227A2B6D79, 0xD5F9E858292504D5, 0xC2B5A03F71471A6F, 0x59300222B4561E00,
+    0xCE2F8642CA0712DC, 0x7CA9723FBB2E8988, 0x2785338347F2BA08, 0xC61BB3A141E50E8C,
+    0x150F361DAB9DEC26, 0x9F6A419D382595F4, 0x64A53DC924FE7AC9, 0x142DE49FFF7A7C3D,
+    0x0C335248857FA9E7, 0x0A9C32D5EAE45305, 0xE6C42178C4BBB92E, 0x71F1CE2490D20B07,
+    0xF1BCC3D275AFE51A, 0xE728E8C83C334074, 0x96FBF83A12884624, 0x81A1549FD6573DA5,
+    0x5FA7867CAF35E149, 0x56986E2EF3ED091B, 0x917F1DD5F8886C61, 0xD20D8C88C8FFE65F,
+    0x31D71DCE64B2C310, 0xF165B587DF898190, 0xA57E6339DD2CF3A0, 0x1EF6E6DBB1961EC9,
+    0x70CC73D90BC26E24, 0xE21A6B35DF0C3AD7, 0x003A93D8B2806962, 0x1C99DED33CB890A1,
+    0xCF3145DE0ADD4289, 0xD0E4427A5514FB72, 0x77C621CC9FB3A483, 0x67A34DAC4356550B,
+    0xF8D626AAAF278509
+};
+
+void initBookKeys() {
+    copy(POLYGLOT_RANDOM64, POLYGLOT_RANDOM64 + 781, bookKeys);
+    if(!bookKeysMatch()) throw runtime_error("The built-in book keys do not give the Polyglot test keys");
+}
+
+void loadBookKeys(string& path) {
+    // 781 hex numbers, "0x" prefixes and commas are fine so a C array can be pasted in
+    ifstream in(path);
+    if(!in) throw runtime_error("Cannot open book keys " + path);
+    string token;
+    int count = 0;
+    while(in >> token && count < 781) {
+        for(auto& c : token) if(c == ',') c = ' ';
+        stringstream parts(token);
+        string part;
+        while(parts >> part && count < 781) {
+            bookKeys[count++] = stoull(part, nullptr, 16);
+        }
+    }
+    if(count != 781) throw runtime_error("Book keys need 781 numbers, found " + to_string(count));
+
+    // a table with one wrong number would quietly miss every book position it touches
+    if(!bookKeysMatch()) throw runtime_error("Book keys in " + path + " are not the Polyglot Random64 table");
+}
+
+// plays out each test line, without touching the game's history
+bool bookKeysMatch() {
+    for(auto& test : POLYGLOT_TEST_KEYS) {
+        Board boardState;
+        initialBoard(boardState);
+        bool team = true;
+        stringstream moves(test.first);
+        string move;
+        while(moves >> move) {
+            string internal = parseMove(boardState, move, team);
+            simulateMove(boardState, internal);
+            team = !team;
+        }
+        if(bookKey(boardState, team) != test.second) return false;
+    }
+    return true;
+}
 
-    Piece knightBlack;
-    knightBlack.color = false;
-    knightBlack.name = 'N';
+bool openBook(string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0) return false;
 
-    boardState[7][1] = knightWhite;
-    boardState[0][1] = knightBlack;
+    struct stat info;
+    if(fstat(fd, &info) != 0 || info.st_size < 16) {
+        close(fd);
+        return false;
+    }
 
-    Piece knightWhite2;
-    knightWhite2.color = true;
-    knightWhite2.name = 'N';
+    // mapped, not read: pages are only faulted in along the binary search
+    void* data = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED) return false;
 
-    Piece knightBlack2;
-    knightBlack2.color = false;
-    knightBlack2.name = 'N';
+    bookData = (const unsigned char*)data;
+    bookEntries = info.st_size / 16;
+    return true;
+}
 
-    boardState[7][6] = knightWhite2;
-    boardState[0][6] = knightBlack2;
+uint64_t readBigEndian(const unsigned char* data, int bytes) {
+    uint64_t value = 0;
+    for(int b = 0; b < bytes; ++b) value = value << 8 | data[b];
+    return value;
+}
 
+uint64_t bookKey(Board& boardState, bool team) {
+    uint64_t key = 0;
 
-    Piece rookWhite;
-    rookWhite.color = true;
-    rookWhite.name = 'R';
+    // pieces: kind is black pawn 0, white pawn 1, black knight 2 ... white king 11
+    // squares count from a1, so our row i is rank 8 - i
+    for(int i = 0; i < 8; ++i) {
+        for(int j = 0; j < 8; ++j) {
+            if(boardState[i][j].name != '-') {
+                int kind = 2 * pieceIndex(boardState[i][j].name) + (boardState[i][j].color ? 1 : 0);
+                key ^= bookKeys[64 * kind + 8 * (7 - i) + j];
+            }
+        }
+    }
 
-    Piece rookBlack;
-    rookBlack.color = false;
-    rookBlack.name = 'R';
+    // castling rights are in the same order as polyglot's
+    int rights = castlingRights(boardState);
+    for(int r = 0; r < 4; ++r) {
+        if(rights >> r & 1) key ^= bookKeys[768 + r];
+    }
 
-    boardState[7][0] = rookWhite;
-    boardState[0][0] = rookBlack;
+    // en passant file, only when one of our pawns could actually take
+    for(int j = 0; j < 8; ++j) {
+        int row = team ? 3 : 4;
+        Piece& pushed = boardState[row][j];
+        if(pushed.name != 'P' || !pushed.passant) continue;
+        for(int dj = -1; dj <= 1; dj += 2) {
+            if(onBoard(row, j + dj) && boardState[row][j + dj].name == 'P' && boardState[row][j + dj].color == team) {
+                key ^= bookKeys[772 + j];
+                break;
+            }
+        }
+    }
 
-    Piece rookWhite2;
-    rookWhite2.color = true;
-    rookWhite2.name = 'R';
+    if(team) key ^= bookKeys[780];
+    return key;
+}
 
-    Piece rookBlack2;
-    rookBlack2.color = false;
-    rookBlack2.name = 'R';
+string probeBook(Board& boardState, bool team) {
+    if(bookData == nullptr) return "";
 
-    boardState[7][7] = rookWhite2;
-    boardState[0][7] = rookBlack2;
+    uint64_t key = bookKey(boardState, team);
 
-    Piece bishopWhite;
-    bishopWhite.color = true;
-    bishopWhite.name = 'B';
+    // entries are sorted by key, find the first one for this position
+    size_t low = 0, high = bookEntries;
+    while(low < high) {
+        size_t mid = (low + high) / 2;
+        if(readBigEndian(bookData + 16 * mid, 8) < key) low = mid + 1;
+        else high = mid;
+    }
 
-    Piece bishopBlack;
-    bishopBlack.color = false;
-    bishopBlack.name = 'B';
+    // keep the moves that are legal here, a key collision could suggest anything
+    vector<string> moves = legalMoves(boardState, team);
+    vector<pair<string, int>> candidates;
+    int totalWeight = 0;
+    for(size_t e = low; e < bookEntries && readBigEndian(bookData + 16 * e, 8) == key; ++e) {
+        int move = readBigEndian(bookData + 16 * e + 8, 2);
+        int weight = readBigEndian(bookData + 16 * e + 10, 2);
+
+        int toI = 7 - ((move >> 3) & 7), toJ = move & 7;
+        int fromI = 7 - ((move >> 9) & 7), fromJ = (move >> 6) & 7;
+
+        // polyglot castles by taking our own rook
+        Piece& mover = boardState[fromI][fromJ];
+        Piece& target = boardState[toI][toJ];
+        if(mover.name == 'K' && target.name == 'R' && target.color == mover.color) toJ = toJ > fromJ ? 6 : 2;
+
+        string internal = to_string(fromI) + to_string(fromJ) + to_string(toI) + to_string(toJ);
+        int promotion = (move >> 12) & 7;
+        if(promotion) internal += " NBRQ"[promotion];
+        if(find(moves.begin(), moves.end(), internal) == moves.end()) continue;
+
+        candidates.push_back({internal, weight});
+        totalWeight += weight;
+    }
+    if(candidates.empty()) return "";
+
+    // pick proportionally to the weights, all zero means any of them
+    static mt19937 rng(random_device{}());
+    if(totalWeight == 0) return candidates[rng() % candidates.size()].first;
+    int pick = rng() % totalWeight;
+    for(auto& candidate : candidates) {
+        if(pick < candidate.second) return candidate.first;
+        pick -= candidate.second;
+    }
+    return candidates.back().first;
+}
 
-    boardState[7][2] = bishopWhite;
-    boardState[0][2] = bishopBlack;
+void makeBook(string& path) {
+    // one game per line as uci moves, every position/move pair seen adds one to its weight
+    map<pair<uint64_t, int>, int> counts;
+    string line;
+    while(getline(cin, line)) {
+        Board boardState;
+        initialBoard(boardState);
+        stringstream moves(line);
+        string move;
+        bool team = true;
+        while(moves >> move) {
+            if(!isMoveString(move)) continue;
+
+            int fromI, fromJ, toI, toJ;
+            string from = move.substr(0, 2);
+            string to = move.substr(2, 2);
+            convertToIJ(from, fromI, fromJ);
+            convertToIJ(to, toI, toJ);
+            // castling is written as the king taking its own rook
+            if(boardState[fromI][fromJ].name == 'K' && abs(toJ - fromJ) == 2) toJ = toJ > fromJ ? 7 : 0;
+            int encoded = (7 - toI) << 3 | toJ | (7 - fromI) << 9 | fromJ << 6;
+            if(move.size() == 5) encoded |= (string(" nbrq").find(move[4])) << 12;
+            uint64_t key = bookKey(boardState, team);
+
+            try {
+                playMove(boardState, move, team);
+            } catch(runtime_error& e) {
+                cerr << "skipping rest of line at " << move << endl;
+                break;
+            }
+            ++counts[{key, encoded}];
+            team = !team;
+        }
+    }
 
-    Piece bishopWhite2;
-    bishopWhite2.color = true;
-    bishopWhite2.name = 'B';
+    ofstream out(path, ios::binary);
+    if(!out) throw runtime_error("Cannot write book " + path);
+    for(auto& entry : counts) {
+        unsigned char record[16] = {0};
+        uint64_t key = entry.first.first;
+        int weight = min(entry.second, 65535);
+        for(int b = 0; b < 8; ++b) record[b] = key >> (56 - 8 * b);
+        record[8] = entry.first.second >> 8;
+        record[9] = entry.first.second & 255;
+        record[10] = weight >> 8;
+        record[11] = weight & 255;
+        out.write((const char*)record, 16);
+    }
+    cerr << counts.size() << " book entries written to " << path << endl;
+}
 
-    Piece bishopBlack2;
-    bishopBlack2.color = false;
-    bishopBlack2.name = 'B';
+// row and column steps, rows grow towards white's side of the board
+const int straightSteps[4][2] = { {1, 0}, {-1, 0}, {0, 1}, {0, -1} };
+const int diagonalSteps[4][2] = { {1, 1}, {1, -1}, {-1, 1}, {-1, -1} };
+const int knightJumps[8][2] = { {1, 2}, {1, -2}, {-1, 2}, {-1, -2}, {2, 1}, {2, -1}, {-2, 1}, {-2, -1} };
+const int kingSteps[8][2] = { {1, 0}, {-1, 0}, {0, 1}, {0, -1}, {1, 1}, {1, -1}, {-1, 1}, {-1, -1} };
 
-    boardState[7][5] = bishopWhite2;
-    boardState[0][5] = bishopBlack2;
+bool onBoard(int i, int j) {
+    return i >= 0 && i < 8 && j >= 0 && j < 8;
+}
 
-    Piece kingWhite;
-    kingWhite.color = true;
-    kingWhite.name = 'K';
+template<Color By>
+bool squareAttacked(Board& boardState, int i, int j) {
+    constexpr bool byTeam = By == WHITE;
+    // white pawns take towards row 0, so they attack from the row below
+    constexpr int pawnStep = byTeam ? 1 : -1;
+    int pawnRow = i + pawnStep;
+    for(int dj = -1; dj <= 1; dj += 2) {
+        if(onBoard(pawnRow, j + dj)) {
+            Piece& p = boardState[pawnRow][j + dj];
+            if(p.name == 'P' && p.color == byTeam) return true;
+        }
+    }
 
-    Piece kingBlack;
-    kingBlack.color = false;
-    kingBlack.name = 'K';
+    for(auto& jump : knightJumps) {
+        int ti = i + jump[0], tj = j + jump[1];
+        if(onBoard(ti, tj) && boardState[ti][tj].name == 'N' && boardState[ti][tj].color == byTeam) return true;
+    }
+    for(auto& step : kingSteps) {
+        int ti = i + step[0], tj = j + step[1];
+        if(onBoard(ti, tj) && boardState[ti][tj].name == 'K' && boardState[ti][tj].color == byTeam) return true;
+    }
 
-    boardState[7][4] = kingWhite;
-    boardState[0][4] = kingBlack;
+    // sliders, the first piece on each ray decides
+    for(int d = 0; d < 8; ++d) {
+        const int* step = d < 4 ? straightSteps[d] : diagonalSteps[d - 4];
+        char slider = d < 4 ? 'R' : 'B';
+        int ti = i + step[0], tj = j + step[1];
+        while(onBoard(ti, tj) && boardState[ti][tj].name == '-') {
+            ti += step[0];
+            tj += step[1];
+        }
+        if(onBoard(ti, tj) && boardState[ti][tj].color == byTeam
+            && (boardState[ti][tj].name == slider || boardState[ti][tj].name == 'Q')) return true;
+    }
+    return false;
+}
 
-    Piece queenWhite;
-    queenWhite.color = true;
-    queenWhite.name = 'Q';
+bool squareAttacked(Board& boardState, int i, int j, bool byTeam) {
+    return byTeam ? squareAttacked<WHITE>(boardState, i, j) : squareAttacked<BLACK>(boardState, i, j);
+}
 
-    Piece queenBlack;
-    queenBlack.color = false;
-    queenBlack.name = 'Q';
+int castlingRights(Board& boardState) {
+    // bit 0 white short, 1 white long, 2 black short, 3 black long
+    // a right lasts while neither the king nor that rook has moved or been taken
+    int rights = 0;
+    for(int side = 0; side < 2; ++side) {
+        int row = side == 0 ? 7 : 0;
+        bool color = side == 0;
+        Piece& king = boardState[row][4];
+        if(king.name != 'K' || king.color != color || king.moved) continue;
+        Piece& shortRook = boardState[row][7];
+        Piece& longRook = boardState[row][0];
+        if(shortRook.name == 'R' && shortRook.color == color && !shortRook.moved) rights |= 1 << (2 * side);
+        if(longRook.name == 'R' && longRook.color == color && !longRook.moved) rights |= 2 << (2 * side);
+    }
+    return rights;
+}
 
-    boardState[7][3] = queenWhite;
-    boardState[0][3] = queenBlack;
+vector<string> legalMoves(Board& boardState, bool team, int genType, int onlySquare) {
+    // for callers outside the search, which want a vector to keep
+    MoveList list;
+    generateMoves(boardState, team, list, genType, onlySquare);
+    return vector<string>(list.moves, list.moves + list.size);
 }
 
-void printBoard(vector<vector<Piece>>& boardState) {
-    for(int i = 0; i < 8; ++i) {
+template<Color Us>
+void generateMoves(Board& boardState, MoveList& list, int genType, int onlySquare) {
+    // genType picks captures (with promotions), quiets or both
+    // onlySquare limits the moves to the piece on row * 8 + column
+    // the side is a template argument, so every color test below is decided at compile time
+    constexpr bool team = Us == WHITE;
+    constexpr Color Them = Us == WHITE ? BLACK : WHITE;
+    list.size = 0;
+
+    int kingI = -1, kingJ = -1;
+    for(int i = 0; i < 8 && kingI == -1; ++i) {
         for(int j = 0; j < 8; ++j) {
-            if(boardState[i][j].name == '-') cout << " " << boardState[i][j].name << " ";
-            else {
-                cout << boardState[i][j].name;
-                if(boardState[i][j].color) cout << "w ";
-                else cout << "b ";
+            if(boardState[i][j].name == 'K' && boardState[i][j].color == team) {
+                kingI = i;
+                kingJ = j;
+                break;
             }
         }
-        cout << endl;
     }
-}
+    if(kingI == -1) return;
 
-void printPossibleMoves(vector<vector<Piece>>& boardState) {
+    // squares that answer a check: taking the checker or blocking its ray
+    // pins: a piece alone between our king and an enemy slider stays on that line
+    int checkers = 0;
+    bool evasion[8][8];
+    bool pinned[8][8];
     for(int i = 0; i < 8; ++i) {
         for(int j = 0; j < 8; ++j) {
-            if(boardState[i][j].name != '-') {
-                cout << boardState[i][j].name;
-                if(boardState[i][j].color) cout << "w ";
-                else cout << "b ";
-                vector<string> moves = possibleMoves(boardState, i, j);
-                for(auto& s : boardState[i][j].possibleMove) cout << s << " ";
-                cout << endl;
-            }
+            evasion[i][j] = false;
+            pinned[i][j] = false;
         }
     }
-}
 
-
-vector<string> possibleMoves(vector<vector<Piece>>& boardState, int i, int j) {
-    vector<string> toReturn;
-    if(boardState[i][j].name == '-') return toReturn;
-
-    else if(boardState[i][j].name == 'P') {
-        if(boardState[i][j].color) { // if white
-            if(i > 0) {
-                string toAdd = to_string(i-1) + to_string(j);
-                if(validSpot(toAdd, boardState)) {
-                    toReturn.push_back(toAdd);
-                    if(i == 6) {
-                        string toAdd = to_string(i-2) + to_string(j);
-                        if(validSpot(toAdd, boardState)) toReturn.push_back(toAdd);
-                    }
-                }
-            }
-            if(i > 0) {
-                if(j > 0) {
-                    if(boardState[i-1][j-1].name != '-' && !boardState[i-1][j-1].color) {
-                        string toAdd = to_string(i-1) + to_string(j-1);
-                        // no need to check if "valid", taking a piece
-                        toReturn.push_back(toAdd);
-                    }
-                }
-                if(j < 7) {
-                    if(boardState[i-1][j+1].name != '-' && !boardState[i-1][j+1].color) {
-                        string toAdd = to_string(i-1) + to_string(j+1);
-                        // no need to check if "valid", taking a piece
-                        toReturn.push_back(toAdd);
-                    }
-                }
+    constexpr int pawnStep = team ? -1 : 1;
+    int pawnRow = kingI + pawnStep;
+    for(int dj = -1; dj <= 1; dj += 2) {
+        if(onBoard(pawnRow, kingJ + dj)) {
+            Piece& p = boardState[pawnRow][kingJ + dj];
+            if(p.name == 'P' && p.color != team) {
+                ++checkers;
+                evasion[pawnRow][kingJ + dj] = true;
             }
         }
-        else { // if black
-            if(i < 7) {
-                string toAdd = to_string(i+1) + to_string(j);
-                if(validSpot(toAdd, boardState)) {
-                    toReturn.push_back(toAdd);
-                    if(i == 1) {
-                        string toAdd = to_string(i+2) + to_string(j);
-                        if(validSpot(toAdd, boardState)) toReturn.push_back(toAdd);
-                    }
-                }
-            }
-            if(i < 7) {
-                if(j > 0) {
-                    if(boardState[i+1][j-1].name != '-' && boardState[i+1][j-1].color) {
-                        string toAdd = to_string(i+1) + to_string(j-1);
-                        // no need to check if "valid", taking a piece
-                        toReturn.push_back(toAdd);
-                    }
+    }
+    for(auto& jump : knightJumps) {
+        int ti = kingI + jump[0], tj = kingJ + jump[1];
+        if(onBoard(ti, tj) && boardState[ti][tj].name == 'N' && boardState[ti][tj].color != team) {
+            ++checkers;
+            evasion[ti][tj] = true;
+        }
+    }
+    for(int d = 0; d < 8; ++d) {
+        const int* step = d < 4 ? straightSteps[d] : diagonalSteps[d - 4];
+        char slider = d < 4 ? 'R' : 'B';
+        int blockerI = -1, blockerJ = -1;
+        int ti = kingI + step[0], tj = kingJ + step[1];
+        while(onBoard(ti, tj)) {
+            Piece& p = boardState[ti][tj];
+            if(p.name != '-') {
+                if(p.color == team) {
+                    // a second piece of ours on the ray, nothing is pinned
+                    if(blockerI != -1) break;
+                    blockerI = ti;
+                    blockerJ = tj;
                 }
-                if(j < 7) {
-                    if(boardState[i+1][j+1].name != '-' && boardState[i+1][j+1].color) {
-                        string toAdd = to_string(i+1) + to_string(j+1);
-                        // no need to check if "valid", taking a piece
-                        toReturn.push_back(toAdd);
+                else {
+                    if(p.name == slider || p.name == 'Q') {
+                        if(blockerI != -1) pinned[blockerI][blockerJ] = true;
+                        else {
+                            ++checkers;
+                            for(int ri = kingI + step[0], rj = kingJ + step[1]; ri != ti + step[0] || rj != tj + step[1]; ri += step[0], rj += step[1]) {
+                                evasion[ri][rj] = true;
+                            }
+                        }
                     }
+                    break;
                 }
             }
+            ti += step[0];
+            tj += step[1];
+        }
+    }
+
+    auto allowed = [&](int fromI, int fromJ, int toI, int toJ) {
+        if(checkers && !evasion[toI][toJ]) return false;
+        // a pinned piece keeps to the line through the king
+        if(pinned[fromI][fromJ] && (fromI - kingI) * (toJ - kingJ) != (fromJ - kingJ) * (toI - kingI)) return false;
+        return true;
+    };
+    auto add = [&](int fromI, int fromJ, int toI, int toJ, char promotion) {
+        if(onlySquare != -1 && fromI * 8 + fromJ != onlySquare) return;
+        bool tactical = boardState[toI][toJ].name != '-' || promotion;
+        if((genType == GEN_CAPTURES && !tactical) || (genType == GEN_QUIETS && tactical)) return;
+        string& move = list.moves[list.size++];
+        move.assign({ char('0' + fromI), char('0' + fromJ), char('0' + toI), char('0' + toJ) });
+        if(promotion) move += promotion;
+    };
 
+    // the king may not step along a checking ray either, so it is lifted off while testing
+    Piece king = boardState[kingI][kingJ];
+    boardState[kingI][kingJ] = Piece();
+    for(auto& step : kingSteps) {
+        int ti = kingI + step[0], tj = kingJ + step[1];
+        if(!onBoard(ti, tj)) continue;
+        if(boardState[ti][tj].name != '-' && boardState[ti][tj].color == team) continue;
+        if(!squareAttacked<Them>(boardState, ti, tj)) add(kingI, kingJ, ti, tj, 0);
+    }
+    boardState[kingI][kingJ] = king;
+
+    // castling: not out of, through or into check, with the squares between empty
+    int rights = castlingRights(boardState) >> (team ? 0 : 2) & 3;
+    if(rights && !checkers) {
+        int row = kingI;
+        if((rights & 1) && boardState[row][5].name == '-' && boardState[row][6].name == '-'
+            && !squareAttacked<Them>(boardState, row, 5) && !squareAttacked<Them>(boardState, row, 6)) {
+            add(row, 4, row, 6, 0);
+        }
+        if((rights & 2) && boardState[row][1].name == '-' && boardState[row][2].name == '-' && boardState[row][3].name == '-'
+            && !squareAttacked<Them>(boardState, row, 2) && !squareAttacked<Them>(boardState, row, 3)) {
+            add(row, 4, row, 2, 0);
         }
-        return toReturn;
     }
 
-    else if(boardState[i][j].name == 'N') { // Knight
-        if(boardState[i][j].color) { // if white
-            if(i > 0 && j < 6) {
-                if(boardState[i-1][j+2].name == '-' || !boardState[i-1][j+2].color) {
-                    string toAdd = to_string(i-1) + to_string(j+2);
-                    toReturn.push_back(toAdd);
-                }
-            }
-            if(i > 0 && j > 2) {
-                if(boardState[i-1][j-2].name == '-' || !boardState[i-1][j-2].color) {
-                    string toAdd = to_string(i-1) + to_string(j-2);
-                    toReturn.push_back(toAdd);
-                }
-            }
+    // in double check only the king can move
+    if(checkers >= 2) return;
 
-            if(i < 7 && j < 6) {
-                if(boardState[i+1][j+2].name == '-' || !boardState[i+1][j+2].color) {
-                    string toAdd = to_string(i+1) + to_string(j+2);
-                    toReturn.push_back(toAdd);
-                }
-            }
-            if(i < 7 && j > 2) {
-                if(boardState[i+1][j-2].name == '-' || !boardState[i+1][j-2].color) {
-                    string toAdd = to_string(i+1) + to_string(j-2);
-                    toReturn.push_back(toAdd);
+    for(int i = 0; i < 8; ++i) {
+        for(int j = 0; j < 8; ++j) {
+            Piece& p = boardState[i][j];
+            if(p.name == '-' || p.color != team || p.name == 'K') continue;
+            if(onlySquare != -1 && i * 8 + j != onlySquare) continue;
+
+            if(p.name == 'P') {
+                constexpr int dir = team ? -1 : 1;
+                constexpr int startRow = team ? 6 : 1;
+                constexpr int lastRow = team ? 0 : 7;
+                int targets[4][2];
+                int targetCount = 0;
+                if(onBoard(i + dir, j) && boardState[i + dir][j].name == '-') {
+                    targets[targetCount][0] = i + dir;
+                    targets[targetCount++][1] = j;
+                    if(i == startRow && boardState[i + 2 * dir][j].name == '-') {
+                        targets[targetCount][0] = i + 2 * dir;
+                        targets[targetCount++][1] = j;
+                    }
                 }
-            }
+                for(int dj = -1; dj <= 1; dj += 2) {
+                    if(!onBoard(i + dir, j + dj)) continue;
+                    Piece& target = boardState[i + dir][j + dj];
+                    if(target.name != '-' && target.color != team) {
+                        targets[targetCount][0] = i + dir;
+                        targets[targetCount++][1] = j + dj;
+                    }
 
-            if(i > 1 && j < 7) {
-                if(boardState[i-2][j+1].name == '-' || !boardState[i-2][j+1].color) {
-                    string toAdd = to_string(i-2) + to_string(j+1);
-                    toReturn.push_back(toAdd);
+                    // en passant, rare enough to just play it on the board, look at the king and take it back
+                    Piece& beside = boardState[i][j + dj];
+                    if(genType != GEN_QUIETS && target.name == '-' && beside.name == 'P' && beside.color != team && beside.passant
+                        && (onlySquare == -1 || onlySquare == i * 8 + j)) {
+                        Piece pawn = boardState[i][j];
+                        Piece taken = beside;
+                        target = pawn;
+                        boardState[i][j] = Piece();
+                        boardState[i][j + dj] = Piece();
+                        bool legal = !inCheck<Us>(boardState);
+                        boardState[i][j] = pawn;
+                        boardState[i][j + dj] = taken;
+                        target = Piece();
+                        if(legal) {
+                            string& move = list.moves[list.size++];
+                            move.assign({ char('0' + i), char('0' + j), char('0' + i + dir), char('0' + j + dj) });
+                        }
+                    }
                 }
-            }
-            if(i > 1 && j > 0) {
-                if(boardState[i-2][j-1].name == '-' || !boardState[i-2][j-1].color) {
-                    string toAdd = to_string(i-2) + to_string(j-1);
-                    toReturn.push_back(toAdd);
+                for(int t = 0; t < targetCount; ++t) {
+                    int ti = targets[t][0], tj = targets[t][1];
+                    if(!allowed(i, j, ti, tj)) continue;
+                    if(ti == lastRow) {
+                        for(char promotion : { 'Q', 'R', 'B', 'N' }) add(i, j, ti, tj, promotion);
+                    }
+                    else add(i, j, ti, tj, 0);
                 }
+                continue;
             }
 
-            if(i < 6 && j < 7) {
-                if(boardState[i+2][j+1].name == '-' || !boardState[i+2][j+1].color) {
-                    string toAdd = to_string(i+2) + to_string(j+1);
-                    toReturn.push_back(toAdd);
+            if(p.name == 'N') {
+                for(auto& jump : knightJumps) {
+                    int ti = i + jump[0], tj = j + jump[1];
+                    if(!onBoard(ti, tj)) continue;
+                    if(boardState[ti][tj].name != '-' && boardState[ti][tj].color == team) continue;
+                    if(allowed(i, j, ti, tj)) add(i, j, ti, tj, 0);
                 }
+                continue;
             }
-            if(i < 6 && j > 0) {
-                if(boardState[i+2][j-1].name == '-' || !boardState[i+2][j-1].color) {
-                    string toAdd = to_string(i+2) + to_string(j-1);
-                    toReturn.push_back(toAdd);
+
+            // rooks, bishops and queens slide until something is in the way
+            for(int d = 0; d < 8; ++d) {
+                if(d < 4 && p.name == 'B') continue;
+                if(d >= 4 && p.name == 'R') continue;
+                const int* step = d < 4 ? straightSteps[d] : diagonalSteps[d - 4];
+                int ti = i + step[0], tj = j + step[1];
+                while(onBoard(ti, tj)) {
+                    if(boardState[ti][tj].name != '-' && boardState[ti][tj].color == team) break;
+                    if(allowed(i, j, ti, tj)) add(i, j, ti, tj, 0);
+                    if(boardState[ti][tj].name != '-') break;
+                    ti += step[0];
+                    tj += step[1];
                 }
             }
-
         }
+    }
+}
 
-        else { // if black
-            if(i > 0 && j < 6) {
-                if(boardState[i-1][j+2].color) {
-                    string toAdd = to_string(i-1) + to_string(j+2);
-                    toReturn.push_back(toAdd);
-                }
-            }
-            if(i > 0 && j > 2) {
-                if(boardState[i-1][j-2].color) {
-                    string toAdd = to_string(i-1) + to_string(j-2);
-                    toReturn.push_back(toAdd);
-                }
-            }
+void generateMoves(Board& boardState, bool team, MoveList& list, int genType, int onlySquare) {
+    if(team) generateMoves<WHITE>(boardState, list, genType, onlySquare);
+    else generateMoves<BLACK>(boardState, list, genType, onlySquare);
+}
 
-            if(i < 7 && j < 6) {
-                if(boardState[i+1][j+2].color) {
-                    string toAdd = to_string(i+1) + to_string(j+2);
-                    toReturn.push_back(toAdd);
-                }
-            }
-            if(i < 7 && j > 1) {
-                if(boardState[i+1][j-2].color) {
-                    string toAdd = to_string(i+1) + to_string(j-2);
-                    toReturn.push_back(toAdd);
-                }
+template<Color Us>
+bool inCheck(Board& boardState) {
+    constexpr Color Them = Us == WHITE ? BLACK : WHITE;
+    for(int i = 0; i < 8; ++i) {
+        for(int j = 0; j < 8; ++j) {
+            if(boardState[i][j].name == 'K' && boardState[i][j].color == (Us == WHITE)) {
+                return squareAttacked<Them>(boardState, i, j);
             }
+        }
+    }
+    return false;
+}
 
-            if(i > 1 && j < 7) {
-                if(boardState[i-2][j+1].color) {
-                    string toAdd = to_string(i-2) + to_string(j+1);
-                    toReturn.push_back(toAdd);
-                }
-            }
-            if(i > 1 && j > 0) {
-                if(boardState[i-2][j-1].color) {
-                    string toAdd = to_string(i-2) + to_string(j-1);
-                    toReturn.push_back(toAdd);
-                }
-            }
+bool inCheck(Board& boardState, bool team) {
+    return team ? inCheck<WHITE>(boardState) : inCheck<BLACK>(boardState);
+}
 
-            if(i < 6 && j < 7) {
-                if(boardState[i+2][j+1].color) {
-                    string toAdd = to_string(i+2) + to_string(j+1);
-                    toReturn.push_back(toAdd);
-                }
-            }
-            if(i < 6 && j > 0) {
-                if(boardState[i+2][j-1].color) {
-                    string toAdd = to_string(i+2) + to_string(j-1);
-                    toReturn.push_back(toAdd);
-                }
-            }
 
-        }
-        return toReturn;
+// captures and pawn moves reset the fifty move count
+bool isIrreversible(Board& boardState, string& move) {
+    return isCapture(boardState, move) || boardState[move[0] - '0'][move[1] - '0'].name == 'P';
+}
 
+// the fifty move rule, or the position at ply already seen since the last irreversible move
+// in this search or in the game before it, a single repeat is scored as the draw it can be forced into
+bool isDraw(uint64_t key, int ply) {
+    int halfmove = plyScratch[ply].halfmove;
+    plyScratch[ply].key = key;
+    if(halfmove >= 100) return true;
+
+    // the same side has to be to move, and it takes at least four plies to come back
+    for(int back = 4; back <= halfmove; back += 2) {
+        int earlier = ply - back;
+        uint64_t seen = earlier >= 1 ? plyScratch[earlier].key : gameKeys[gameKeys.size() - 1 + earlier];
+        if(seen == key) return true;
     }
+    return false;
+}
 
-    else if(boardState[i][j].name == 'R') { // Rook
-        if(boardState[i][j].color) { // if white
-            bool yesPlus = true;
-            bool yesMinus = true;
-            for(int c = 1; c < 8; ++c) {
-                if(!yesPlus && !yesMinus) break;
-                if(yesPlus && i + c < 8) {
-                    if(boardState[i + c][j].name == '-' || !boardState[i + c][j].color) {
-                        string toAdd = to_string(i+c) + to_string(j);
-                        toReturn.push_back(toAdd);
-                        if (!boardState[i + c][j].color) yesPlus = false;
-                    }
-                    else yesPlus = false;
+bool isCapture(Board& boardState, string& move) {
+    // promotions count too, they change the material just the same
+    Piece& mover = boardState[move[0] - '0'][move[1] - '0'];
+    return boardState[move[2] - '0'][move[3] - '0'].name != '-' || move.size() == 5
+        || (mover.name == 'P' && move[1] != move[3]);
+}
 
-                }
-                else yesPlus = false;
+// static exchange evaluation: what the side moving wins on the target square, in seeValue units
+// if both sides keep recapturing with their cheapest piece for as long as it pays
+// pieces are lifted off a copy as they capture, so sliders lined up behind them join in
+int see(Board& boardState, string& move) {
+    int fromI = move[0] - '0', fromJ = move[1] - '0', toI = move[2] - '0', toJ = move[3] - '0';
+    Board squares = boardState;
+
+    Piece mover = squares[fromI][fromJ];
+    int gain[32];
+    gain[0] = squares[toI][toJ].name == '-' ? 0 : seeValue[pieceIndex(squares[toI][toJ].name)];
+    // en passant takes a pawn from beside the target
+    if(mover.name == 'P' && fromJ != toJ && squares[toI][toJ].name == '-') {
+        gain[0] = seeValue[0];
+        squares[fromI][toJ].name = '-';
+    }
+    int onSquare = seeValue[pieceIndex(mover.name)];
+    if(move.size() == 5) {
+        onSquare = seeValue[pieceIndex(move[4])];
+        gain[0] += onSquare - seeValue[0];
+        mover.name = move[4];
+    }
+    squares[toI][toJ] = mover;
+    squares[fromI][fromJ].name = '-';
+
+    int d = 0;
+    bool side = !mover.color;
+    int attackerI, attackerJ;
+    while(d < 31) {
+        int attacker = leastValuableAttacker(squares, toI, toJ, side, attackerI, attackerJ);
+        if(attacker == 0) break;
+        ++d;
+        gain[d] = onSquare - gain[d - 1];
+        squares[toI][toJ] = squares[attackerI][attackerJ];
+        squares[attackerI][attackerJ].name = '-';
+        onSquare = attacker;
+        side = !side;
+    }
+    // each side can stop capturing whenever that is better for it
+    for(; d > 0; --d) gain[d - 1] = -max(-gain[d - 1], gain[d]);
+    return gain[0];
+}
 
-                if(yesMinus && i - c > -1) {
-                    if(boardState[i - c][j].name == '-' || !boardState[i - c][j].color) {
-                        string toAdd = to_string(i-c) + to_string(j);
-                        toReturn.push_back(toAdd);
+// the value of side's cheapest piece attacking (i, j) and where it stands, 0 when there is none
+int leastValuableAttacker(Board& squares, int i, int j, bool side, int& fromI, int& fromJ) {
+    int best = 0;
+    auto consider = [&](int ai, int aj) {
+        int value = seeValue[pieceIndex(squares[ai][aj].name)];
+        if(best == 0 || value < best) {
+            best = value;
+            fromI = ai;
+            fromJ = aj;
+        }
+    };
 
-                        if (!boardState[i - c][j].color) yesMinus = false;
-                    }
-                    else yesMinus = false;
+    // white pawns take towards row 0, so they attack from the row below
+    int pawnRow = side ? i + 1 : i - 1;
+    for(int dj = -1; dj <= 1; dj += 2) {
+        if(onBoard(pawnRow, j + dj) && squares[pawnRow][j + dj].name == 'P' && squares[pawnRow][j + dj].color == side) {
+            consider(pawnRow, j + dj);
+        }
+    }
+    // nothing is cheaper than a pawn
+    if(best) return best;
 
-                }
-                else yesMinus = false;
-            }
+    for(auto& jump : knightJumps) {
+        int ti = i + jump[0], tj = j + jump[1];
+        if(onBoard(ti, tj) && squares[ti][tj].name == 'N' && squares[ti][tj].color == side) consider(ti, tj);
+    }
+    for(int d = 0; d < 8; ++d) {
+        const int* step = d < 4 ? straightSteps[d] : diagonalSteps[d - 4];
+        char slider = d < 4 ? 'R' : 'B';
+        int ti = i + step[0], tj = j + step[1];
+        while(onBoard(ti, tj) && squares[ti][tj].name == '-') {
+            ti += step[0];
+            tj += step[1];
+        }
+        if(onBoard(ti, tj) && squares[ti][tj].color == side && (squares[ti][tj].name == slider || squares[ti][tj].name == 'Q')) {
+            consider(ti, tj);
+        }
+    }
+    for(auto& step : kingSteps) {
+        int ti = i + step[0], tj = j + step[1];
+        if(onBoard(ti, tj) && squares[ti][tj].name == 'K' && squares[ti][tj].color == side) consider(ti, tj);
+    }
+    return best;
+}
 
-            yesPlus = true;
-            yesMinus = true;
-            for(int c = 1; c < 8; ++c) {
-                if(!yesPlus && !yesMinus) break;
-                if(yesPlus && j + c < 8) {
-                    if(boardState[i][j + c].name == '-' || !boardState[i][j + c].color) {
-                        string toAdd = to_string(i) + to_string(j+c);
-                        toReturn.push_back(toAdd);
-                        if (!boardState[i][j + c].color) yesPlus = false;
-                    }
-                    else yesPlus = false;
+void initPicker(MovePicker& picker, Board& boardState, string& hashMove, int ply) {
+    picker.boardState = &boardState;
+    picker.hashMove = hashMove;
+    if(ply < MAX_PLY) {
+        picker.killers[0] = killerMoves[ply][0];
+        picker.killers[1] = killerMoves[ply][1];
+        picker.counter = plyScratch[ply].lastMove;
+        if(ply >= 2) picker.followup = plyScratch[ply - 1].lastMove;
+        uint16_t refutation = picker.counter >= 0 ? counterMoves[picker.counter].load(memory_order_relaxed) : 0;
+        if(refutation) {
+            int from = (refutation >> 6) & 63, to = refutation & 63;
+            picker.killers[2] = string{char('0' + from / 8), char('0' + from % 8), char('0' + to / 8), char('0' + to % 8)};
+        }
+    }
+}
 
-                }
-                else yesPlus = false;
+int moveIndex(Piece& piece, string& move) {
+    return (pieceIndex(piece.name) + (piece.color ? 0 : 6)) * 64 + (move[2] - '0') * 8 + (move[3] - '0');
+}
 
-                if(yesMinus && j - c > -1) {
-                    if(boardState[i][j - c].name == '-' || !boardState[i][j - c].color) {
-                        string toAdd = to_string(i) + to_string(j - c);
-                        toReturn.push_back(toAdd);
-                        if (!boardState[i][j - c].color) yesMinus = false;
-                    }
-                    else yesMinus = false;
+// moves the entry towards +-HISTORY_MAX by bonus, less the closer it already is
+void updateHistory(atomic<int16_t>& entry, int bonus) {
+    int value = entry.load(memory_order_relaxed);
+    value += bonus - value * abs(bonus) / HISTORY_MAX;
+    entry.store(value, memory_order_relaxed);
+}
 
+template<Color Us>
+bool nextMove(MovePicker& picker, string& move) {
+    Board& boardState = *picker.boardState;
+    MoveList& list = *picker.moves;
+    while(true) {
+        if(picker.stage == PICK_HASH) {
+            picker.stage = PICK_GEN_CAPTURES;
+            // keys can collide, only a legal move of ours is trusted
+            string stored = picker.hashMove;
+            picker.hashMove.clear();
+            if(stored.size() < 4) continue;
+            MoveList& candidates = *picker.scratch;
+            generateMoves<Us>(boardState, candidates, GEN_ALL, (stored[0] - '0') * 8 + (stored[1] - '0'));
+            for(int m = 0; m < candidates.size; ++m) {
+                if(candidates.moves[m] == stored) {
+                    picker.hashMove = candidates.moves[m];
+                    move = picker.hashMove;
+                    return true;
                 }
-                else yesMinus = false;
             }
         }
-
-        else { // if black
-            bool yesPlus = true;
-            bool yesMinus = true;
-            for(int c = 1; c < 8; ++c) {
-                if(!yesPlus && !yesMinus) break;
-                if(yesPlus && i + c < 8) {
-                    if(boardState[i + c][j].name == '-' || boardState[i + c][j].color) {
-                        string toAdd = to_string(i+c) + to_string(j);
-                        toReturn.push_back(toAdd);
-                        if (boardState[i + c][j].name != '-' && boardState[i + c][j].color) yesPlus = false;
-                    }
-                    else yesPlus = false;
-
+        else if(picker.stage == PICK_GEN_CAPTURES) {
+            // most valuable victim first, the cheapest attacker breaks ties
+            // a capture that loses the exchange is set aside for the end
+            generateMoves<Us>(boardState, list, GEN_CAPTURES);
+            MoveList& bad = *picker.bad;
+            bad.size = 0;
+            int order[MAX_MOVES];
+            int good = 0;
+            for(int m = 0; m < list.size; ++m) {
+                string& c = list.moves[m];
+                Piece& target = boardState[c[2] - '0'][c[3] - '0'];
+                int victim = target.name == '-' ? 1 : seeValue[pieceIndex(target.name)];
+                if(c.size() == 5) victim += seeValue[pieceIndex(c[4])];
+                int attacker = seeValue[pieceIndex(boardState[c[0] - '0'][c[1] - '0'].name)];
+                // taking something worth at least the attacker can't lose, only the rest need the exchange
+                if(victim < attacker && see(boardState, c) < 0) {
+                    bad.moves[bad.size++] = c;
+                    continue;
                 }
-                else yesPlus = false;
-
-                if(yesMinus && i - c > -1) {
-                    if(boardState[i - c][j].name == '-' || boardState[i - c][j].color) {
-                        string toAdd = to_string(i-c) + to_string(j);
-                        toReturn.push_back(toAdd);
-                        if (boardState[i - c][j].name != '-' && boardState[i - c][j].color) yesMinus = false;
+                order[good] = 16 * victim - attacker;
+                if(good != m) list.moves[good] = c;
+                ++good;
+            }
+            list.size = good;
+            // insertion sort, the lists are short and it needs no buffer
+            for(int m = 1; m < list.size; ++m) {
+                for(int k = m; k > 0 && order[k] > order[k - 1]; --k) {
+                    swap(order[k], order[k - 1]);
+                    swap(list.moves[k], list.moves[k - 1]);
+                }
+            }
+            picker.index = 0;
+            picker.stage = PICK_CAPTURES;
+        }
+        else if(picker.stage == PICK_CAPTURES) {
+            while(picker.index < list.size) {
+                move = list.moves[picker.index++];
+                if(move != picker.hashMove) return true;
+            }
+            picker.index = 0;
+            picker.stage = PICK_BAD_CAPTURES;
+        }
+        else if(picker.stage == PICK_BAD_CAPTURES) {
+            MoveList& bad = *picker.bad;
+            while(picker.index < bad.size) {
+                move = bad.moves[picker.index++];
+                if(move != picker.hashMove) return true;
+            }
+            picker.index = 0;
+            picker.stage = PICK_KILLERS;
+        }
+        else if(picker.stage == PICK_KILLERS) {
+            // a killer comes from another position, it has to be a legal quiet move here
+            while(picker.index < 3) {
+                string& killer = picker.killers[picker.index++];
+                if(killer.empty() || killer == picker.hashMove
+                    || (picker.index == 3 && (killer == picker.killers[0] || killer == picker.killers[1]))) {
+                    killer.clear();
+                    continue;
+                }
+                MoveList& quiets = *picker.scratch;
+                generateMoves<Us>(boardState, quiets, GEN_QUIETS, (killer[0] - '0') * 8 + (killer[1] - '0'));
+                if(find(quiets.moves, quiets.moves + quiets.size, killer) == quiets.moves + quiets.size) {
+                    killer.clear();
+                    continue;
+                }
+                move = killer;
+                return true;
+            }
+            picker.stage = PICK_GEN_QUIETS;
+        }
+        else if(picker.stage == PICK_GEN_QUIETS) {
+            // best history first, what worked after the same moves elsewhere in the tree
+            generateMoves<Us>(boardState, list, GEN_QUIETS);
+            if(picker.counter >= 0 || picker.followup >= 0) {
+                int order[MAX_MOVES];
+                for(int m = 0; m < list.size; ++m) {
+                    string& q = list.moves[m];
+                    int index = moveIndex(boardState[q[0] - '0'][q[1] - '0'], q);
+                    order[m] = (picker.counter >= 0 ? counterHistory[picker.counter][index].load(memory_order_relaxed) : 0)
+                             + (picker.followup >= 0 ? followupHistory[picker.followup][index].load(memory_order_relaxed) : 0);
+                }
+                for(int m = 1; m < list.size; ++m) {
+                    for(int k = m; k > 0 && order[k] > order[k - 1]; --k) {
+                        swap(order[k], order[k - 1]);
+                        swap(list.moves[k], list.moves[k - 1]);
                     }
-                    else yesMinus = false;
-
                 }
-                else yesMinus = false;
             }
+            picker.index = 0;
+            picker.stage = PICK_QUIETS;
+        }
+        else if(picker.stage == PICK_QUIETS) {
+            while(picker.index < list.size) {
+                move = list.moves[picker.index++];
+                if(move != picker.hashMove && move != picker.killers[0] && move != picker.killers[1] && move != picker.killers[2]) return true;
+            }
+            picker.stage = PICK_DONE;
+        }
+        else return false;
+    }
+}
 
-            yesPlus = true;
-            yesMinus = true;
-            for(int c = 1; c < 8; ++c) {
-                if(!yesPlus && !yesMinus) break;
-                if(yesPlus && j + c < 8) {
-                    if(boardState[i][j + c].name == '-' || boardState[i][j + c].color) {
-                        string toAdd = to_string(i) + to_string(j+c);
-                        toReturn.push_back(toAdd);
-                        if (boardState[i][j + c].name != '-' && boardState[i][j + c].color) yesPlus = false;
-                    }
-                    else yesPlus = false;
+// used ai for the scoring tables
+// only effective for midgame
+
+const int pawnTable[8][8] = {
+    {  0,  5,  5, -10, -10,  5,  5,  0 },
+    {  0, 10, 10,   0,   0, 10, 10,  0 },
+    {  0, 10, 20,  30,  30, 20, 10,  0 },
+    {  0, 10, 10,  20,  20, 10, 10,  0 },
+    {  0, 10, 10,  20,  20, 10, 10,  0 },
+    {  0, 10, 10,   0,   0, 10, 10,  0 },
+    {  0,  5,  5, -10, -10,  5,  5,  0 },
+    {  0,  0,  0,   0,   0,  0,  0,  0 }
+};
+
+const int knightTable[8][8] = {
+    { -50, -40, -30, -30, -30, -30, -40, -50 },
+    { -40, -20,   0,   0,   0,   0, -20, -40 },
+    { -30,   0,  10,  15,  15,  10,   0, -30 },
+    { -30,   5,  15,  20,  20,  15,   5, -30 },
+    { -30,   0,  15,  20,  20,  15,   0, -30 },
+    { -30,   5,  10,  15,  15,  10,   5, -30 },
+    { -40, -20,   0,   5,   5,   0, -20, -40 },
+    { -50, -40, -30, -30, -30, -30, -40, -50 }
+};
+
+const int bishopTable[8][8] = {
+    { -20, -10, -10, -10, -10, -10, -10, -20 },
+    { -10,   5,   0,   0,   0,   0,   5, -10 },
+    { -10,  10,  10,  10,  10,  10,  10, -10 },
+    { -10,   0,  10,  10,  10,  10,   0, -10 },
+    { -10,   5,   5,  10,  10,   5,   5, -10 },
+    { -10,   0,   5,  10,  10,   5,   0, -10 },
+    { -10,   0,   0,   0,   0,   0,   0, -10 },
+    { -20, -10, -10, -10, -10, -10, -10, -20 }
+};
+
+const int rookTable[8][8] = {
+    {  0,   0,   0,   5,   5,   0,   0,   0 },
+    {  0,   0,   0,   5,   5,   0,   0,   0 },
+    {  0,   0,   0,   5,   5,   0,   0,   0 },
+    {  5,   5,   5,  10,  10,   5,   5,   5 },
+    {  5,   5,   5,  10,  10,   5,   5,   5 },
+    {  0,   0,   0,   5,   5,   0,   0,   0 },
+    {  0,   0,   0,   5,   5,   0,   0,   0 },
+    {  0,   0,   0,   0,   0,   0,   0,   0 }
+};
 
-                }
-                else yesPlus = false;
+const int queenTable[8][8] = {
+    { -20, -10, -10,  -5,  -5, -10, -10, -20 },
+    { -10,   0,   0,   0,   0,   0,   0, -10 },
+    { -10,   0,   5,   5,   5,   5,   0, -10 },
+    {  -5,   0,   5,   5,   5,   5,   0,  -5 },
+    {   0,   0,   5,   5,   5,   5,   0,  -5 },
+    { -10,   5,   5,   5,   5,   5,   0, -10 },
+    { -10,   0,   5,   0,   0,   0,   0, -10 },
+    { -20, -10, -10,  -5,  -5, -10, -10, -20 }
+};
 
-                if(yesMinus && j - c > -1) {
-                    if(boardState[i][j - c].name == '-' || boardState[i][j - c].color) {
-                        string toAdd = to_string(i) + to_string(j - c);
-                        toReturn.push_back(toAdd);
-                        if (boardState[i][j - c].name != '-' && boardState[i][j - c].color) yesMinus = false;
-                    }
-                    else yesMinus = false;
+const int kingTable[8][8] = {
+    { -30, -40, -40, -50, -50, -40, -40, -30 },
+    { -30, -40, -40, -50, -50, -40, -40, -30 },
+    { -30, -40, -40, -50, -50, -40, -40, -30 },
+    { -30, -40, -40, -50, -50, -40, -40, -30 },
+    { -20, -30, -30, -40, -40, -30, -30, -20 },
+    { -10, -20, -20, -20, -20, -20, -20, -10 },
+    {  20,  20,   0,   0,   0,   0,  20,  20 },
+    {  20,  30,  10,   0,   0,  10,  30,  20 }
+};
 
-                }
-                else yesMinus = false;
-            }
+// piece value plus table value for every piece letter and square, packed int16
+// '-' and the letters that are not pieces stay 0, so empty squares need no test
+// the gather reads 4 bytes per 2 byte entry, hence the spare entries at the end
+alignas(32) int16_t evalTable[128 * 64 + 2];
+
+// material and table sum from white's side, the widest version the cpu runs is picked at startup
+int (*scoreMaterial)(Board& boardState) = scoreMaterialScalar;
+
+// a row of the board is 8 Pieces of 2 bytes, one 128 bit load widened to 32 bit lanes
+// color is the lowest bit of the first byte, the name the second byte
+static_assert(sizeof(Piece) == 2 && offsetof(Piece, name) == 1, "Piece layout changed");
+
+void initEval() {
+    const char names[6] = { 'P', 'N', 'B', 'R', 'Q', 'K' };
+    const int values[6] = { 1, 5, 3, 3, 9, 100 };
+    const int (*tables[6])[8] = { pawnTable, knightTable, bishopTable, rookTable, queenTable, kingTable };
+    for(int k = 0; k < 6; ++k) {
+        for(int sq = 0; sq < 64; ++sq) {
+            evalTable[names[k] * 64 + sq] = values[k] + tables[k][sq / 8][sq % 8];
         }
     }
 
-    else if(boardState[i][j].name == 'B') { // Bishop
-        if(boardState[i][j].color) { // if white
-            bool yesPlus = true;
-            bool yesMinus = true;
-            for(int c = 1; c < 8; ++c) {
-                if(!yesPlus && !yesMinus) break;
-                if(yesPlus && i + c < 8 && j + c < 8) {
-                    if(boardState[i + c][j + c].name == '-' || !boardState[i + c][j + c].color) {
-                        string toAdd = to_string(i+c) + to_string(j+c);
-                        toReturn.push_back(toAdd);
-                        if (!boardState[i + c][j + c].color) yesPlus = false;
-                    }
-                    else yesPlus = false;
-
-                }
-                else yesPlus = false;
+#if defined(__x86_64__) || defined(__i386__)
+    if(__builtin_cpu_supports("avx2")) scoreMaterial = scoreMaterialAVX2;
+#endif
+    cerr << "evaluation: " << (scoreMaterial == scoreMaterialScalar ? "scalar" : "avx2") << endl;
+}
 
-                if(yesMinus && i - c > -1 && j - c > -1) {
-                    if(boardState[i - c][j - c].name == '-' || !boardState[i - c][j - c].color) {
-                        string toAdd = to_string(i-c) + to_string(j-c);
-                        toReturn.push_back(toAdd);
-                        if (!boardState[i - c][j - c].color) yesMinus = false;
-                    }
-                    else yesMinus = false;
+int scoreMaterialScalar(Board& boardState) {
+    int score = 0;
+    for(int i = 0; i < 8; ++i) {
+        for(int j = 0; j < 8; ++j) {
+            Piece& p = boardState[i][j];
+            int value = evalTable[(unsigned char)p.name * 64 + i * 8 + j];
+            score += p.color ? value : -value;
+        }
+    }
+    return score;
+}
 
-                }
-                else yesMinus = false;
-            }
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+int scoreMaterialAVX2(Board& boardState) {
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i lowByte = _mm256_set1_epi32(255);
+    const __m256i one = _mm256_set1_epi32(1);
+    __m256i sum = _mm256_setzero_si256();
+    for(int i = 0; i < 8; ++i) {
+        __m256i row = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)boardState[i]));
+        __m256i name = _mm256_and_si256(_mm256_srli_epi32(row, 8), lowByte);
+        // 0 for white, all ones for black
+        __m256i black = _mm256_sub_epi32(_mm256_and_si256(row, one), one);
+
+        __m256i index = _mm256_add_epi32(_mm256_slli_epi32(name, 6), _mm256_add_epi32(lanes, _mm256_set1_epi32(8 * i)));
+        __m256i value = _mm256_i32gather_epi32((const int*)evalTable, index, 2);
+        // keep the low int16 of each lane, then negate black's
+        value = _mm256_srai_epi32(_mm256_slli_epi32(value, 16), 16);
+        value = _mm256_sub_epi32(_mm256_xor_si256(value, black), black);
+        sum = _mm256_add_epi32(sum, value);
+    }
+    __m128i half = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+    half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0x4E));
+    half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0xB1));
+    return _mm_cvtsi128_si32(half);
+}
+#endif
+
+void loadNNUE(string& path) {
+    ifstream in(path, ios::binary);
+    if(!in) throw runtime_error("Cannot open network " + path);
+
+    char magic[8];
+    uint32_t hidden = 0;
+    in.read(magic, 8);
+    in.read((char*)&hidden, 4);
+    if(!in || memcmp(magic, "CMPNNUE1", 8) != 0) throw runtime_error("Not a network file " + path);
+    if(hidden == 0 || hidden % 32 || hidden > NNUE_MAX_HIDDEN) {
+        throw runtime_error("Network width must be a multiple of 32 up to " + to_string(NNUE_MAX_HIDDEN));
+    }
 
-            yesPlus = true;
-            yesMinus = true;
-            for(int c = 1; c < 8; ++c) {
-                if(!yesPlus && !yesMinus) break;
-                if(yesPlus && i + c < 8 && j - c > -1) {
-                    if(boardState[i + c][j - c].name == '-' || !boardState[i + c][j - c].color) {
-                        string toAdd = to_string(i+c) + to_string(j-c);
-                        toReturn.push_back(toAdd);
-                        if (!boardState[i + c][j - c].color) yesPlus = false;
-                    }
-                    else yesPlus = false;
+    nnueHidden = hidden;
+    nnueFeatureWeights.resize(NNUE_FEATURES * hidden);
+    nnueFeatureBias.resize(hidden);
+    nnueOutputWeights.resize(2 * hidden);
+    in.read((char*)nnueFeatureWeights.data(), nnueFeatureWeights.size() * sizeof(int16_t));
+    in.read((char*)nnueFeatureBias.data(), nnueFeatureBias.size() * sizeof(int16_t));
+    in.read((char*)nnueOutputWeights.data(), nnueOutputWeights.size());
+    in.read((char*)&nnueOutputBias, 4);
+    if(!in) throw runtime_error("Network file is truncated " + path);
+
+#if defined(__x86_64__) || defined(__i386__)
+    if(__builtin_cpu_supports("avx2")) nnueOutput = nnueOutputAVX2;
+#endif
+    nnueEnabled = true;
+    cerr << "network " << path << ": 768x" << hidden << "x2, " << (nnueOutput == nnueOutputScalar ? "scalar" : "avx2") << endl;
+}
 
-                }
-                else yesPlus = false;
+int nnueFeature(int perspective, Piece& piece, int i, int j) {
+    // each side sees the board from its own end, its pieces first
+    int own = piece.color == (perspective == 0) ? 0 : 1;
+    int row = perspective == 0 ? i : 7 - i;
+    return (own * 6 + pieceIndex(piece.name)) * 64 + row * 8 + j;
+}
 
-                if(yesMinus && i - c > -1 && j + c < 8) {
-                    if(boardState[i - c][j + c].name == '-' || !boardState[i - c][j + c].color) {
-                        string toAdd = to_string(i-c) + to_string(j+c);
-                        toReturn.push_back(toAdd);
-                        if (!boardState[i - c][j + c].color) yesMinus = false;
-                    }
-                    else yesMinus = false;
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target_clones("avx2", "default")))
+#endif
+void nnueAddRow(int16_t* values, const int16_t* row, int hidden, int sign) {
+    // plain loop, vectorized for each target the clone is built for
+    for(int k = 0; k < hidden; ++k) values[k] += sign * row[k];
+}
 
-                }
-                else yesMinus = false;
+void nnueRefresh(Board& boardState, Accumulator& accumulator) {
+    for(int perspective = 0; perspective < 2; ++perspective) {
+        int16_t* values = accumulator.values[perspective];
+        copy(nnueFeatureBias.begin(), nnueFeatureBias.end(), values);
+        for(int i = 0; i < 8; ++i) {
+            for(int j = 0; j < 8; ++j) {
+                if(boardState[i][j].name == '-') continue;
+                int feature = nnueFeature(perspective, boardState[i][j], i, j);
+                nnueAddRow(values, &nnueFeatureWeights[feature * nnueHidden], nnueHidden, 1);
             }
         }
+    }
+}
 
-        else { // if black
-            bool yesPlus = true;
-            bool yesMinus = true;
-            for(int c = 1; c < 8; ++c) {
-                if(!yesPlus && !yesMinus) break;
-                if(yesPlus && i + c < 8 && j + c < 8) {
-                    if(boardState[i + c][j + c].name == '-' || boardState[i + c][j + c].color) {
-                        string toAdd = to_string(i+c) + to_string(j+c);
-                        toReturn.push_back(toAdd);
-                        if (boardState[i + c][j + c].name != '-' && boardState[i + c][j + c].color) yesPlus = false;
-                        
-                    }
-                    else yesPlus = false;
+void nnueUpdate(Accumulator& parent, Accumulator& child, Board& boardState, string& move) {
+    // a move changes at most two pieces: the mover, and a captured pawn or piece or the castling rook
+    // boardState is the parent position, before move
+    int fromI = move[0] - '0', fromJ = move[1] - '0';
+    int toI = move[2] - '0', toJ = move[3] - '0';
+    Piece mover = boardState[fromI][fromJ];
+    Piece placed = mover;
+    if(move.size() == 5) placed.name = move[4];
+
+    int changes = 0;
+    int squares[4][2];
+    Piece pieces[4];
+    int signs[4];
+    auto change = [&](Piece& piece, int i, int j, int sign) {
+        pieces[changes] = piece;
+        squares[changes][0] = i;
+        squares[changes][1] = j;
+        signs[changes++] = sign;
+    };
 
-                }
-                else yesPlus = false;
+    change(mover, fromI, fromJ, -1);
+    change(placed, toI, toJ, 1);
+    if(boardState[toI][toJ].name != '-') change(boardState[toI][toJ], toI, toJ, -1);
+    else if(mover.name == 'P' && fromJ != toJ) change(boardState[fromI][toJ], fromI, toJ, -1);
+    else if(mover.name == 'K' && abs(toJ - fromJ) == 2) {
+        int rookJ = toJ > fromJ ? 7 : 0;
+        change(boardState[fromI][rookJ], fromI, rookJ, -1);
+        change(boardState[fromI][rookJ], fromI, (fromJ + toJ) / 2, 1);
+    }
 
-                if(yesMinus && i - c > -1 && j - c > -1) {
-                    if(boardState[i - c][j - c].name == '-' || boardState[i - c][j - c].color) {
-                        string toAdd = to_string(i-c) + to_string(j-c);
-                        toReturn.push_back(toAdd);
-                         if (boardState[i - c][j - c].name != '-' &&boardState[i - c][j - c].color) yesMinus = false;
-                    }
-                    else yesMinus = false;
+    for(int perspective = 0; perspective < 2; ++perspective) {
+        int16_t* values = child.values[perspective];
+        copy(parent.values[perspective], parent.values[perspective] + nnueHidden, values);
+        for(int c = 0; c < changes; ++c) {
+            int feature = nnueFeature(perspective, pieces[c], squares[c][0], squares[c][1]);
+            nnueAddRow(values, &nnueFeatureWeights[feature * nnueHidden], nnueHidden, signs[c]);
+        }
+    }
+}
 
-                }
-                else yesMinus = false;
-            }
+int nnueOutputScalar(const int16_t* us, const int16_t* them, const int8_t* weights, int hidden) {
+    int sum = 0;
+    for(int k = 0; k < hidden; ++k) {
+        sum += min(max((int)us[k], 0), 127) * weights[k];
+        sum += min(max((int)them[k], 0), 127) * weights[hidden + k];
+    }
+    return sum;
+}
 
-            yesPlus = true;
-            yesMinus = true;
-            for(int c = 1; c < 8; ++c) {
-                if(!yesPlus && !yesMinus) break;
-                if(yesPlus && i + c < 8 && j - c > -1) {
-                    if(boardState[i + c][j - c].name == '-' || boardState[i + c][j - c].color) {
-                        string toAdd = to_string(i+c) + to_string(j-c);
-                        toReturn.push_back(toAdd);
-                         if (boardState[i + c][j - c].name != '-' &&boardState[i + c][j - c].color) yesPlus = false;
-                    }
-                    else yesPlus = false;
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+int nnueOutputAVX2(const int16_t* us, const int16_t* them, const int8_t* weights, int hidden) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi16(1);
+    __m256i sum = zero;
+    for(int half = 0; half < 2; ++half) {
+        const int16_t* values = half ? them : us;
+        const int8_t* w = weights + half * hidden;
+        for(int k = 0; k < hidden; k += 32) {
+            // clamp to 0..127 while packing 32 int16 into 32 uint8, then put the lanes back in order
+            __m256i a = _mm256_loadu_si256((const __m256i*)(values + k));
+            __m256i b = _mm256_loadu_si256((const __m256i*)(values + k + 16));
+            __m256i packed = _mm256_packus_epi16(a, b);
+            packed = _mm256_min_epu8(packed, _mm256_set1_epi8(127));
+            packed = _mm256_permute4x64_epi64(packed, 0xD8);
+
+            // uint8 x int8 pairs to int16, then pairs of those to int32
+            __m256i products = _mm256_maddubs_epi16(packed, _mm256_loadu_si256((const __m256i*)(w + k)));
+            sum = _mm256_add_epi32(sum, _mm256_madd_epi16(products, ones));
+        }
+    }
+    __m128i half = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+    half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0x4E));
+    half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0xB1));
+    return _mm_cvtsi128_si32(half);
+}
+#endif
+
+int nnueEvaluate(Accumulator& accumulator, bool team) {
+    // the side to move's half comes first, the result is from white's side like evaluateScore
+    const int16_t* us = accumulator.values[team ? 0 : 1];
+    const int16_t* them = accumulator.values[team ? 1 : 0];
+    int score = (nnueOutput(us, them, nnueOutputWeights.data(), nnueHidden) + nnueOutputBias) / 64;
+    return team ? score : -score;
+}
 
-                }
-                else yesPlus = false;
+template<Color Us>
+int evaluateScore(Board& boardState) {
+    constexpr Color Them = Us == WHITE ? BLACK : WHITE;
+    int score = scoreMaterial(boardState);
+    if constexpr (Us == BLACK) score = -score;
 
-                if(yesMinus && i - c > -1 && j + c < 8) {
-                    if(boardState[i - c][j + c].name == '-' || boardState[i - c][j + c].color) {
-                        string toAdd = to_string(i-c) + to_string(j+c);
-                        toReturn.push_back(toAdd);
-                         if (boardState[i - c][j + c].name != '-' && boardState[i - c][j + c].color) yesMinus = false;
-                    }
-                    else yesMinus = false;
+    if (inCheck<Us>(boardState)) {
+        score -= 60; // Apply a large penalty if the king is in check
+    }
 
-                }
-                else yesMinus = false;
-            }
-        }
+    // Check if the opponent's king is in check
+    if (inCheck<Them>(boardState)) {
+        score += 60; // Apply a large reward if the opponent's king is in check
     }
 
-    else if(boardState[i][j].name == 'Q') { // Queen
-        if(boardState[i][j].color) { // if white
-            bool yesPlus = true;
-            bool yesMinus = true;
-            for(int c = 1; c < 8; ++c) {
-                if(!yesPlus && !yesMinus) break;
-                if(yesPlus && i + c < 8 && j + c < 8) {
-                    if(boardState[i + c][j + c].name == '-' || !boardState[i + c][j + c].color) {
-                        string toAdd = to_string(i+c) + to_string(j+c);
-                        toReturn.push_back(toAdd);
-                        if (!boardState[i + c][j + c].color) yesPlus = false;
-                    }
-                    else yesPlus = false;
+    return score;
+}
 
-                }
-                else yesPlus = false;
+int evaluateScore(Board& boardState, bool team) {
+    return team ? evaluateScore<WHITE>(boardState) : evaluateScore<BLACK>(boardState);
+}
 
-                if(yesMinus && i - c > -1 && j - c > -1) {
-                    if(boardState[i - c][j - c].name == '-' || !boardState[i - c][j - c].color) {
-                        string toAdd = to_string(i-c) + to_string(j-c);
-                        toReturn.push_back(toAdd);
-                        if (!boardState[i - c][j - c].color) yesMinus = false;
-                    }
-                    else yesMinus = false;
+void simulateMove(Board& boardState, string& move) {
+    // move comes from legalMoves, so it is applied without checking it again
+    int currI = move[0] - '0';
+    int currJ = move[1] - '0';
+    int endI = move[2] - '0';
+    int endJ = move[3] - '0';
+    Piece currPiece = boardState[currI][currJ];
 
-                }
-                else yesMinus = false;
-            }
+    // en passant only lasts one ply
+    for(int j = 0; j < 8; ++j) {
+        boardState[3][j].passant = false;
+        boardState[4][j].passant = false;
+    }
 
-            yesPlus = true;
-            yesMinus = true;
-            for(int c = 1; c < 8; ++c) {
-                if(!yesPlus && !yesMinus) break;
-                if(yesPlus && i + c < 8 && j - c > -1) {
-                    if(boardState[i + c][j - c].name == '-' || !boardState[i + c][j - c].color) {
-                        string toAdd = to_string(i+c) + to_string(j-c);
-                        toReturn.push_back(toAdd);
-                        if (!boardState[i + c][j - c].color) yesPlus = false;
-                    }
-                    else yesPlus = false;
+    // a pawn moving diagonally to an empty square takes en passant
+    if(currPiece.name == 'P' && currJ != endJ && boardState[endI][endJ].name == '-') {
+        boardState[currI][endJ] = Piece();
+    }
 
-                }
-                else yesPlus = false;
+    // castling is the king moving two squares, the rook jumps over it
+    if(currPiece.name == 'K' && abs(endJ - currJ) == 2) {
+        int rookJ = endJ > currJ ? 7 : 0;
+        boardState[currI][(currJ + endJ) / 2] = boardState[currI][rookJ];
+        boardState[currI][(currJ + endJ) / 2].moved = true;
+        boardState[currI][rookJ] = Piece();
+    }
 
-                if(yesMinus && i - c > -1 && j + c < 8) {
-                    if(boardState[i - c][j + c].name == '-' || !boardState[i - c][j + c].color) {
-                        string toAdd = to_string(i-c) + to_string(j+c);
-                        toReturn.push_back(toAdd);
-                        if (!boardState[i - c][j + c].color) yesMinus = false;
-                    }
-                    else yesMinus = false;
+    currPiece.moved = true;
+    currPiece.passant = currPiece.name == 'P' && abs(endI - currI) == 2;
+    if(move.size() == 5) currPiece.name = move[4];
 
-                }
-                else yesMinus = false;
-            }
-            yesPlus = true;
-            yesMinus = true;
-            for(int c = 1; c < 8; ++c) {
-                if(!yesPlus && !yesMinus) break;
-                if(yesPlus && i + c < 8) {
-                    if(boardState[i + c][j].name == '-' || !boardState[i + c][j].color) {
-                        string toAdd = to_string(i+c) + to_string(j);
-                        toReturn.push_back(toAdd);
-                        if (!boardState[i + c][j].color) yesPlus = false;
-                    }
-                    else yesPlus = false;
+    boardState[endI][endJ] = currPiece;
+    boardState[currI][currJ] = Piece();
+}
 
-                }
-                else yesPlus = false;
 
-                if(yesMinus && i - c > -1) {
-                    if(boardState[i - c][j].name == '-' || !boardState[i - c][j].color) {
-                        string toAdd = to_string(i-c) + to_string(j);
-                        toReturn.push_back(toAdd);
+void playFirstMoves(Board& boardState, vector<string>& moveList) {
+    // we want to start as white
+    bool colorOrder = true;
+    for(auto& move : moveList) {
+        playMove(boardState, move, colorOrder);
+        colorOrder = !colorOrder;
+    }
+}
 
-                        if (!boardState[i - c][j].color) yesMinus = false;
-                    }
-                    else yesMinus = false;
+void playMove(Board& boardState, string& move, bool team) {
+    string internal = parseMove(boardState, move, team);
+    recordMove(boardState, internal);
+}
 
-                }
-                else yesMinus = false;
-            }
+// the internal form of a uci move, throws unless it is legal here
+string parseMove(Board& boardState, string& move, bool team) {
+    string currPos, endPos;
+    int currI, currJ, endI, endJ;
 
-            yesPlus = true;
-            yesMinus = true;
-            for(int c = 1; c < 8; ++c) {
-                if(!yesPlus && !yesMinus) break;
-                if(yesPlus && j + c < 8) {
-                    if(boardState[i][j + c].name == '-' || !boardState[i][j + c].color) {
-                        string toAdd = to_string(i) + to_string(j+c);
-                        toReturn.push_back(toAdd);
-                        if (!boardState[i][j + c].color) yesPlus = false;
-                    }
-                    else yesPlus = false;
+    currPos = move.substr(0, 2);
+    convertToIJ(currPos, currI, currJ);
+    endPos = move.substr(2, 2);
+    convertToIJ(endPos, endI, endJ);
 
-                }
-                else yesPlus = false;
+    // uci promotions are lowercase, ours are the piece name
+    string internal = to_string(currI) + to_string(currJ) + to_string(endI) + to_string(endJ);
+    if(move.size() == 5) internal += toupper(move[4]);
 
-                if(yesMinus && j - c > -1) {
-                    if(boardState[i][j - c].name == '-' || !boardState[i][j - c].color) {
-                        string toAdd = to_string(i) + to_string(j - c);
-                        toReturn.push_back(toAdd);
-                        if (!boardState[i][j - c].color) yesMinus = false;
-                    }
-                    else yesMinus = false;
+    vector<string> moves = legalMoves(boardState, team);
+    if(find(moves.begin(), moves.end(), internal) == moves.end()) throw runtime_error("Illegal move " + move);
+    return internal;
+}
 
-                }
-                else yesMinus = false;
-            }
-        }
+// plays a move in the game and remembers the position it leads to, for repetitions
+void recordMove(Board& boardState, string& move) {
+    bool team = boardState[move[0] - '0'][move[1] - '0'].color;
+    bool irreversible = isIrreversible(boardState, move);
+    simulateMove(boardState, move);
+    // nothing from before a capture or pawn move can come back
+    if(irreversible) gameKeys.clear();
+    gameKeys.push_back(hashBoard(boardState, !team));
+}
 
-        else { // if black
-            bool yesPlus = true;
-            bool yesMinus = true;
-            for(int c = 1; c < 8; ++c) {
-                if(!yesPlus && !yesMinus) break;
-                if(yesPlus && i + c < 8 && j + c < 8) {
-                    if(boardState[i + c][j + c].name == '-' || boardState[i + c][j + c].color) {
-                        string toAdd = to_string(i+c) + to_string(j+c);
-                        toReturn.push_back(toAdd);
-                        if (boardState[i + c][j + c].name != '-' && boardState[i + c][j + c].color) yesPlus = false;
-                        
-                    }
-                    else yesPlus = false;
+void convertToIJ(string& move, int& iVal, int& jVal) {
+    iVal = 7 - (move[1] - 49);
+    jVal = move[0] - 'a';
+    
+}
 
-                }
-                else yesPlus = false;
+string convertToUCI(int iCurr, int jCurr, int iEnd, int jEnd) {
+    char rowStart = '1' + (7 - iCurr);
+    char colStart = 'a' + jCurr;
 
-                if(yesMinus && i - c > -1 && j - c > -1) {
-                    if(boardState[i - c][j - c].name == '-' || boardState[i - c][j - c].color) {
-                        string toAdd = to_string(i-c) + to_string(j-c);
-                        toReturn.push_back(toAdd);
-                         if (boardState[i - c][j - c].name != '-' && boardState[i - c][j - c].color) yesMinus = false;
-                    }
-                    else yesMinus = false;
+    char rowEnd = '1' + (7 - iEnd);
+    char colEnd = 'a' + jEnd;
 
-                }
-                else yesMinus = false;
-            }
+    return string(1, colStart) + string(1, rowStart) + string(1, colEnd) + string(1, rowEnd);
+}
 
-            yesPlus = true;
-            yesMinus = true;
-            for(int c = 1; c < 8; ++c) {
-                if(!yesPlus && !yesMinus) break;
-                if(yesPlus && i + c < 8 && j - c > -1) {
-                    if(boardState[i + c][j - c].name == '-' || boardState[i + c][j - c].color) {
-                        string toAdd = to_string(i+c) + to_string(j-c);
-                        toReturn.push_back(toAdd);
-                         if (boardState[i + c][j - c].name != '-' && boardState[i + c][j - c].color) yesPlus = false;
-                    }
-                    else yesPlus = false;
+string convertToUCI(string& move) {
+    // internal moves are "ijij", board rows and columns of the start and end square
+    // and a promotion piece after them
+    string uci = convertToUCI(move[0] - '0', move[1] - '0', move[2] - '0', move[3] - '0');
+    if(move.size() == 5) uci += tolower(move[4]);
+    return uci;
+}
 
-                }
-                else yesPlus = false;
 
-                if(yesMinus && i - c > -1 && j + c < 8) {
-                    if(boardState[i - c][j + c].name == '-' || boardState[i - c][j + c].color) {
-                        string toAdd = to_string(i-c) + to_string(j+c);
-                        toReturn.push_back(toAdd);
-                         if (boardState[i - c][j + c].name != '-' && boardState[i - c][j + c].color) yesMinus = false;
-                    }
-                    else yesMinus = false;
+void initialBoard(Board& boardState) {
+    for(int i = 2; i < 6; ++i) {
+        for(int j = 0; j < 8; ++j) {
+            Piece basic;
+            basic.color = true;
+            basic.name = '-';
+            boardState[i][j] = basic;
+        }
+    }
 
-                }
-                else yesMinus = false;
-            }
+    for(int j = 0; j < 8; ++j) {
+        Piece pawnWhite;
+        pawnWhite.color = true;
+        pawnWhite.name = 'P';
 
-            yesPlus = true;
-            yesMinus = true;
-            for(int c = 1; c < 8; ++c) {
-                if(!yesPlus && !yesMinus) break;
-                if(yesPlus && i + c < 8) {
-                    if(boardState[i + c][j].name == '-' || boardState[i + c][j].color) {
-                        string toAdd = to_string(i+c) + to_string(j);
-                        toReturn.push_back(toAdd);
-                        if (boardState[i + c][j].name != '-' && boardState[i + c][j].color) yesPlus = false;
-                    }
-                    else yesPlus = false;
+        Piece pawnBlack;
+        pawnBlack.color = false;
+        pawnBlack.name = 'P';
+        
+        boardState[6][j] = pawnWhite;
+        boardState[1][j] = pawnBlack;
+    }
 
-                }
-                else yesPlus = false;
+    Piece knightWhite;
+    knightWhite.color = true;
+    knightWhite.name = 'N';
 
-                if(yesMinus && i - c > -1) {
-                    if(boardState[i - c][j].name == '-' || boardState[i - c][j].color) {
-                        string toAdd = to_string(i-c) + to_string(j);
-                        toReturn.push_back(toAdd);
-                        if (boardState[i - c][j].name != '-' && boardState[i - c][j].color) yesMinus = false;
-                    }
-                    else yesMinus = false;
+    Piece knightBlack;
+    knightBlack.color = false;
+    knightBlack.name = 'N';
 
-                }
-                else yesMinus = false;
-            }
+    boardState[7][1] = knightWhite;
+    boardState[0][1] = knightBlack;
 
-            yesPlus = true;
-            yesMinus = true;
-            for(int c = 1; c < 8; ++c) {
-                if(!yesPlus && !yesMinus) break;
-                if(yesPlus && j + c < 8) {
-                    if(boardState[i][j + c].name == '-' || boardState[i][j + c].color) {
-                        string toAdd = to_string(i) + to_string(j+c);
-                        toReturn.push_back(toAdd);
-                        if (boardState[i][j + c].name != '-' && boardState[i][j + c].color) yesPlus = false;
-                    }
-                    else yesPlus = false;
+    Piece knightWhite2;
+    knightWhite2.color = true;
+    knightWhite2.name = 'N';
 
-                }
-                else yesPlus = false;
+    Piece knightBlack2;
+    knightBlack2.color = false;
+    knightBlack2.name = 'N';
 
-                if(yesMinus && j - c > -1) {
-                    if(boardState[i][j - c].name == '-' || boardState[i][j - c].color) {
-                        string toAdd = to_string(i) + to_string(j - c);
-                        toReturn.push_back(toAdd);
-                        if (boardState[i][j - c].name != '-' && boardState[i][j - c].color) yesMinus = false;
-                    }
-                    else yesMinus = false;
+    boardState[7][6] = knightWhite2;
+    boardState[0][6] = knightBlack2;
 
-                }
-                else yesMinus = false;
-            }
-        }
-    }
 
-    else if(boardState[i][j].name == 'K') { // King
-        if(boardState[i][j].color) { // if white
-            if(i + 1 < 8 && (boardState[i + 1][j].name == '-' || !boardState[i + 1][j].color)) {
-                string toAdd = to_string(i+1) + to_string(j);
-                toReturn.push_back(toAdd);
-            }
+    Piece rookWhite;
+    rookWhite.color = true;
+    rookWhite.name = 'R';
 
-            if(i - 1 > -1 && (boardState[i - 1][j].name == '-' || !boardState[i - 1][j].color)) {
-                string toAdd = to_string(i-1) + to_string(j);
-                toReturn.push_back(toAdd);
-            }
+    Piece rookBlack;
+    rookBlack.color = false;
+    rookBlack.name = 'R';
 
-            if(j + 1 < 8 && (boardState[i][j + 1].name == '-' || !boardState[i][j + 1].color)) {
-                string toAdd = to_string(i) + to_string(j+1);
-                toReturn.push_back(toAdd);
-            }
+    boardState[7][0] = rookWhite;
+    boardState[0][0] = rookBlack;
 
-            if(j - 1 > -1 && (boardState[i][j - 1].name == '-' || !boardState[i][j - 1].color)) {
-                string toAdd = to_string(i) + to_string(j-1);
-                toReturn.push_back(toAdd);
-            }
+    Piece rookWhite2;
+    rookWhite2.color = true;
+    rookWhite2.name = 'R';
 
-            if(i + 1 < 8 && j + 1 < 8 && (boardState[i + 1][j + 1].name == '-' || !boardState[i + 1][j + 1].color)) {
-                string toAdd = to_string(i+1) + to_string(j+1);
-                toReturn.push_back(toAdd);
-            }
+    Piece rookBlack2;
+    rookBlack2.color = false;
+    rookBlack2.name = 'R';
 
-            if(i - 1 > -1 && j - 1 > -1 && (boardState[i - 1][j - 1].name == '-' || !boardState[i - 1][j - 1].color)) {
-                string toAdd = to_string(i-1) + to_string(j-1);
-                toReturn.push_back(toAdd);
-            }
+    boardState[7][7] = rookWhite2;
+    boardState[0][7] = rookBlack2;
 
-            if(j + 1 < 8 && i - 1 > -1 && (boardState[i - 1][j + 1].name == '-' || !boardState[i - 1][j + 1].color)) {
-                string toAdd = to_string(i-1) + to_string(j+1);
-                toReturn.push_back(toAdd);
-            }
+    Piece bishopWhite;
+    bishopWhite.color = true;
+    bishopWhite.name = 'B';
 
-            if(j - 1 > -1 && i + 1 < 8 && (boardState[i + 1][j - 1].name == '-' || !boardState[i + 1][j - 1].color)) {
-                string toAdd = to_string(i+1) + to_string(j-1);
-                toReturn.push_back(toAdd);
-            }
+    Piece bishopBlack;
+    bishopBlack.color = false;
+    bishopBlack.name = 'B';
 
-        }
+    boardState[7][2] = bishopWhite;
+    boardState[0][2] = bishopBlack;
 
-        else { // if black
-            if(i + 1 < 8 && (boardState[i + 1][j].name == '-' || boardState[i + 1][j].color)) {
-                string toAdd = to_string(i+1) + to_string(j);
-                toReturn.push_back(toAdd);
-            }
+    Piece bishopWhite2;
+    bishopWhite2.color = true;
+    bishopWhite2.name = 'B';
 
-            if(i - 1 > -1 && (boardState[i - 1][j].name == '-' || boardState[i - 1][j].color)) {
-                string toAdd = to_string(i-1) + to_string(j);
-                toReturn.push_back(toAdd);
-            }
+    Piece bishopBlack2;
+    bishopBlack2.color = false;
+    bishopBlack2.name = 'B';
 
-            if(j + 1 < 8 && (boardState[i][j + 1].name == '-' || boardState[i][j + 1].color)) {
-                string toAdd = to_string(i) + to_string(j+1);
-                toReturn.push_back(toAdd);
-            }
+    boardState[7][5] = bishopWhite2;
+    boardState[0][5] = bishopBlack2;
 
-            if(j - 1 > -1 && (boardState[i][j - 1].name == '-' || boardState[i][j - 1].color)) {
-                string toAdd = to_string(i) + to_string(j-1);
-                toReturn.push_back(toAdd);
-            }
+    Piece kingWhite;
+    kingWhite.color = true;
+    kingWhite.name = 'K';
 
-            if(i + 1 < 8 && j + 1 < 8 && (boardState[i + 1][j + 1].name == '-' || boardState[i + 1][j + 1].color)) {
-                string toAdd = to_string(i+1) + to_string(j+1);
-                toReturn.push_back(toAdd);
-            }
+    Piece kingBlack;
+    kingBlack.color = false;
+    kingBlack.name = 'K';
 
-            if(i - 1 > -1 && j - 1 > -1 && (boardState[i - 1][j - 1].name == '-' || boardState[i - 1][j - 1].color)) {
-                string toAdd = to_string(i-1) + to_string(j-1);
-                toReturn.push_back(toAdd);
-            }
+    boardState[7][4] = kingWhite;
+    boardState[0][4] = kingBlack;
 
-            if(j + 1 < 8 && i - 1 > -1 && (boardState[i - 1][j + 1].name == '-' || boardState[i - 1][j + 1].color)) {
-                string toAdd = to_string(i-1) + to_string(j+1);
-                toReturn.push_back(toAdd);
-            }
+    Piece queenWhite;
+    queenWhite.color = true;
+    queenWhite.name = 'Q';
+
+    Piece queenBlack;
+    queenBlack.color = false;
+    queenBlack.name = 'Q';
+
+    boardState[7][3] = queenWhite;
+    boardState[0][3] = queenBlack;
+}
 
-            if(j - 1 > -1 && i + 1 < 8 && (boardState[i + 1][j - 1].name == '-' || boardState[i + 1][j - 1].color)) {
-                string toAdd = to_string(i+1) + to_string(j-1);
-                toReturn.push_back(toAdd);
+void printBoard(Board& boardState) {
+    for(int i = 0; i < 8; ++i) {
+        for(int j = 0; j < 8; ++j) {
+            if(boardState[i][j].name == '-') cout << " " << boardState[i][j].name << " ";
+            else {
+                cout << boardState[i][j].name;
+                if(boardState[i][j].color) cout << "w ";
+                else cout << "b ";
             }
         }
+        cout << endl;
     }
-
-    return toReturn;
 }
 
-bool validSpot(string& pos, vector<vector<Piece>>& boardState) {
-    int a = pos[0] - 48;
-    int b = pos[1] - 48;
-    if (a < 0 || a >= 8 || b < 0 || b >= 8) return false;
-    if(boardState[a][b].name == '-') return true;
-    return false;
+void printPossibleMoves(Board& boardState) {
+    vector<string> moves[2] = { legalMoves(boardState, false), legalMoves(boardState, true) };
+    for(int i = 0; i < 8; ++i) {
+        for(int j = 0; j < 8; ++j) {
+            if(boardState[i][j].name != '-') {
+                cout << boardState[i][j].name;
+                if(boardState[i][j].color) cout << "w ";
+                else cout << "b ";
+                for(auto& move : moves[boardState[i][j].color]) {
+                    if(move[0] - '0' == i && move[1] - '0' == j) cout << move.substr(2) << " ";
+                }
+                cout << endl;
+            }
+        }
+    }
 }